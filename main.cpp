@@ -4,57 +4,145 @@
 #include <vector>
 #include <string_view>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <memory>
+#include <memory_resource>
+#include <cstdint>
+#include <charconv>
+#include <ctime>
+#include <new>
+#include <climits>
+#include <cerrno>
+#include <csignal>
+#include <system_error>
+#include <type_traits>
+
+#include <immintrin.h>
+
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <clang-c/Index.h>
+#include <clang-c/CXCompilationDatabase.h>
 
 #define STB_C_LEXER_IMPLEMENTATION
 #include "stb_c_lexer.h"
 
+/**
+ * Entities allocate their strings and vectors from the arena of the
+ * translation unit they were collected from (see IndexUnit), so a unit's
+ * entities cost a few large allocations and are freed in one go.
+ */
+typedef std::pmr::polymorphic_allocator<char> EntityAllocator;
+
 struct Arg {
-    std::string arg_name;
-    std::string arg_type;
+    typedef EntityAllocator allocator_type;
+
+    std::pmr::string arg_name;
+    std::pmr::string arg_type;
+
+    explicit Arg(const allocator_type& alloc = {}) : arg_name(alloc), arg_type(alloc) {}
+
+    Arg(std::string_view arg_name_, std::string_view arg_type_, const allocator_type& alloc = {})
+    : arg_name(arg_name_, alloc), arg_type(arg_type_, alloc) {}
+
+    Arg(const Arg& other, const allocator_type& alloc = {})
+    : arg_name(other.arg_name, alloc), arg_type(other.arg_type, alloc) {}
+
+    Arg(Arg&& other, const allocator_type& alloc)
+    : arg_name(std::move(other.arg_name), alloc), arg_type(std::move(other.arg_type), alloc) {}
+
+    Arg(Arg&&) = default;
+    Arg& operator=(const Arg&) = default;
+    Arg& operator=(Arg&&) = default;
 };
 
 struct SourceLoc {
-    std::string filename;
-    unsigned int line;
-    unsigned int col;
+    typedef EntityAllocator allocator_type;
 
-    SourceLoc() = default;
+    std::pmr::string filename;
+    unsigned int line = 0;
+    unsigned int col = 0;
 
-    SourceLoc(const char* filename_,
+    explicit SourceLoc(const allocator_type& alloc = {}) : filename(alloc) {}
+
+    SourceLoc(std::string_view filename_,
               unsigned int line_,
-              unsigned int col_)
-    : filename(filename_), line(line_), col(col_) {}
+              unsigned int col_,
+              const allocator_type& alloc = {})
+    : filename(filename_, alloc), line(line_), col(col_) {}
+
+    SourceLoc(const SourceLoc& other, const allocator_type& alloc = {})
+    : filename(other.filename, alloc), line(other.line), col(other.col) {}
+
+    SourceLoc(SourceLoc&& other, const allocator_type& alloc)
+    : filename(std::move(other.filename), alloc), line(other.line), col(other.col) {}
+
+    SourceLoc(SourceLoc&&) = default;
+    SourceLoc& operator=(const SourceLoc&) = default;
+    SourceLoc& operator=(SourceLoc&&) = default;
 
     std::string repr() const {
-        return filename + ":" + std::to_string(line) + ":" + std::to_string(col) + ":";
+        return std::string(filename) + ":" + std::to_string(line) + ":" + std::to_string(col) + ":";
     }
 };
 
 struct Function {
+    typedef EntityAllocator allocator_type;
+
     SourceLoc source;
-    std::string return_type;
-    std::string function_name;
-    std::vector<Arg> args;
+    std::pmr::string return_type;
+    std::pmr::string function_name;
+    std::pmr::vector<Arg> args;
 
-    Function() = default;
+    explicit Function(const allocator_type& alloc = {})
+    : source(alloc), return_type(alloc), function_name(alloc), args(alloc) {}
 
-    Function(const char* filename_,
+    Function(std::string_view filename_,
              unsigned int line_,
              unsigned int col_,
-             const char* return_type_,
-             const char* function_name_)
-    :   source(filename_, line_, col_),
-        return_type(return_type_),
-        function_name(function_name_) {}
+             std::string_view return_type_,
+             std::string_view function_name_,
+             const allocator_type& alloc = {})
+    :   source(filename_, line_, col_, alloc),
+        return_type(return_type_, alloc),
+        function_name(function_name_, alloc),
+        args(alloc) {}
+
+    Function(const Function& other, const allocator_type& alloc = {})
+    :   source(other.source, alloc), return_type(other.return_type, alloc),
+        function_name(other.function_name, alloc), args(other.args, alloc) {}
+
+    Function(Function&& other, const allocator_type& alloc)
+    :   source(std::move(other.source), alloc), return_type(std::move(other.return_type), alloc),
+        function_name(std::move(other.function_name), alloc), args(std::move(other.args), alloc) {}
+
+    Function(Function&&) = default;
+    Function& operator=(const Function&) = default;
+    Function& operator=(Function&&) = default;
 
-    void add_arg(const char* arg_name, const char* arg_type) {
-        args.push_back(Arg{arg_name, arg_type});
+    void add_arg(std::string_view arg_name, std::string_view arg_type) {
+        args.emplace_back(arg_name, arg_type);
     }
 
     std::string repr() const {
-        return function_name + " :: " + normal();
+        return std::string(function_name) + " :: " + normal();
     }
 
     std::string full_repr() const {
@@ -62,7 +150,8 @@ struct Function {
     }
 
     std::string normal() const {
-        std::string representation = return_type + " ( ";
+        std::string representation(return_type);
+        representation += " ( ";
         for(int i = 0; i < args.size(); ++i) {
             if (i > 0) representation += " , ";
             representation += args[i].arg_type;
@@ -73,54 +162,104 @@ struct Function {
 };
 
 struct Typedef {
+    typedef EntityAllocator allocator_type;
+
     SourceLoc source;
-    std::string alias;
-    std::string aliased;
+    std::pmr::string alias;
+    std::pmr::string aliased;
 
-    Typedef() = default;
+    explicit Typedef(const allocator_type& alloc = {})
+    : source(alloc), alias(alloc), aliased(alloc) {}
 
-    Typedef(const char* filename_,
+    Typedef(std::string_view filename_,
             unsigned int line_,
             unsigned int col_,
-            const char* alias_,
-            const char* aliased_)
-    :   source(filename_, line_, col_),
-        alias(alias_), aliased(aliased_) {}
+            std::string_view alias_,
+            std::string_view aliased_,
+            const allocator_type& alloc = {})
+    :   source(filename_, line_, col_, alloc),
+        alias(alias_, alloc), aliased(aliased_, alloc) {}
+
+    Typedef(const Typedef& other, const allocator_type& alloc = {})
+    :   source(other.source, alloc), alias(other.alias, alloc), aliased(other.aliased, alloc) {}
+
+    Typedef(Typedef&& other, const allocator_type& alloc)
+    :   source(std::move(other.source), alloc), alias(std::move(other.alias), alloc),
+        aliased(std::move(other.aliased), alloc) {}
+
+    Typedef(Typedef&&) = default;
+    Typedef& operator=(const Typedef&) = default;
+    Typedef& operator=(Typedef&&) = default;
 
     std::string repr() const {
-        return alias + " :: " + aliased;
+        return std::string(alias) + " :: " + std::string(aliased);
     }
 
     std::string normal() const {
-        return alias;
+        return std::string(alias);
     }
 };
 
 struct Attribute {
-    std::string attr_name;
-    std::string attr_type;
+    typedef EntityAllocator allocator_type;
+
+    std::pmr::string attr_name;
+    std::pmr::string attr_type;
+
+    explicit Attribute(const allocator_type& alloc = {}) : attr_name(alloc), attr_type(alloc) {}
+
+    Attribute(std::string_view attr_name_, std::string_view attr_type_, const allocator_type& alloc = {})
+    : attr_name(attr_name_, alloc), attr_type(attr_type_, alloc) {}
+
+    Attribute(const Attribute& other, const allocator_type& alloc = {})
+    : attr_name(other.attr_name, alloc), attr_type(other.attr_type, alloc) {}
+
+    Attribute(Attribute&& other, const allocator_type& alloc)
+    : attr_name(std::move(other.attr_name), alloc), attr_type(std::move(other.attr_type), alloc) {}
+
+    Attribute(Attribute&&) = default;
+    Attribute& operator=(const Attribute&) = default;
+    Attribute& operator=(Attribute&&) = default;
 };
 
 struct Struct {
+    typedef EntityAllocator allocator_type;
+
     SourceLoc source;
-    std::string struct_name;
-    std::vector<Attribute> attributes;
+    std::pmr::string struct_name;
+    std::pmr::vector<Attribute> attributes;
 
-    Struct() = default;
+    explicit Struct(const allocator_type& alloc = {})
+    : source(alloc), struct_name(alloc), attributes(alloc) {}
 
-    Struct(const char* filename_,
+    Struct(std::string_view filename_,
            unsigned int line_,
            unsigned int col_,
-           const char* struct_name_)
-    :   source(filename_, line_, col_),
-        struct_name(struct_name_) {}
+           std::string_view struct_name_,
+           const allocator_type& alloc = {})
+    :   source(filename_, line_, col_, alloc),
+        struct_name(struct_name_, alloc),
+        attributes(alloc) {}
+
+    Struct(const Struct& other, const allocator_type& alloc = {})
+    :   source(other.source, alloc), struct_name(other.struct_name, alloc),
+        attributes(other.attributes, alloc) {}
 
-    void add_attr(const char* attr_name, const char* attr_type) {
-        attributes.push_back(Attribute{attr_name, attr_type});
+    Struct(Struct&& other, const allocator_type& alloc)
+    :   source(std::move(other.source), alloc), struct_name(std::move(other.struct_name), alloc),
+        attributes(std::move(other.attributes), alloc) {}
+
+    Struct(Struct&&) = default;
+    Struct& operator=(const Struct&) = default;
+    Struct& operator=(Struct&&) = default;
+
+    void add_attr(std::string_view attr_name, std::string_view attr_type) {
+        attributes.emplace_back(attr_name, attr_type);
     }
 
     std::string repr() const {
-        std::string representation = struct_name + " { ";
+        std::string representation(struct_name);
+        representation += " { ";
         for(int i = 0; i < attributes.size(); ++i) {
             if (i > 0) representation += ", ";
             representation += attributes[i].attr_name + " :: " + attributes[i].attr_type;
@@ -130,38 +269,56 @@ struct Struct {
     }
 
     std::string normal() const {
-        return struct_name;
+        return std::string(struct_name);
     }
 };
 
 struct Class {
+    typedef EntityAllocator allocator_type;
+
     SourceLoc source;
-    std::string class_name;
-    std::vector<Attribute> attributes;
-    std::vector<Function> methods;
+    std::pmr::string class_name;
+    std::pmr::vector<Attribute> attributes;
+    std::pmr::vector<Function> methods;
 
-    Class() = default;
+    explicit Class(const allocator_type& alloc = {})
+    : source(alloc), class_name(alloc), attributes(alloc), methods(alloc) {}
 
-    Class(const char* filename_,
+    Class(std::string_view filename_,
            unsigned int line_,
            unsigned int col_,
-           const char* class_name_)
-    :   source(filename_, line_, col_),
-        class_name(class_name_) {}
+           std::string_view class_name_,
+           const allocator_type& alloc = {})
+    :   source(filename_, line_, col_, alloc),
+        class_name(class_name_, alloc),
+        attributes(alloc), methods(alloc) {}
+
+    Class(const Class& other, const allocator_type& alloc = {})
+    :   source(other.source, alloc), class_name(other.class_name, alloc),
+        attributes(other.attributes, alloc), methods(other.methods, alloc) {}
 
-    void add_attr(const char* attr_name, const char* attr_type) {
-        attributes.push_back(Attribute{attr_name, attr_type});
+    Class(Class&& other, const allocator_type& alloc)
+    :   source(std::move(other.source), alloc), class_name(std::move(other.class_name), alloc),
+        attributes(std::move(other.attributes), alloc), methods(std::move(other.methods), alloc) {}
+
+    Class(Class&&) = default;
+    Class& operator=(const Class&) = default;
+    Class& operator=(Class&&) = default;
+
+    void add_attr(std::string_view attr_name, std::string_view attr_type) {
+        attributes.emplace_back(attr_name, attr_type);
     }
 
     void add_method(
-        const char* filename_, unsigned int line_, unsigned int col_,
-        std::string return_type_, std::string method_name_)
+        std::string_view filename_, unsigned int line_, unsigned int col_,
+        std::string_view return_type_, std::string_view method_name_)
     {
-        methods.push_back(Function{filename_, line_, col_, return_type_.c_str(), method_name_.c_str()});
+        methods.emplace_back(filename_, line_, col_, return_type_, method_name_);
     }
 
     std::string repr() const {
-        std::string representation = class_name + " { ";
+        std::string representation(class_name);
+        representation += " { ";
         for(int i = 0; i < attributes.size(); ++i) {
             if (i > 0) representation += ", ";
             representation += attributes[i].attr_name + " :: " + attributes[i].attr_type;
@@ -175,310 +332,4915 @@ struct Class {
     }
 
     std::string normal() const {
-        return class_name;
+        return std::string(class_name);
     }
 };
 
+/** A match: the index of the entity in its table, rendered only if it's printed */
 struct Score {
-    std::string id;
+    size_t index;
     int score;
 };
 
-typedef std::vector<Function> FunctionVec;
-typedef std::vector<Typedef> TypedefVec;
-typedef std::vector<Struct> StructVec;
-typedef std::vector<Class> ClassVec;
+typedef std::pmr::vector<Function> FunctionVec;
+typedef std::pmr::vector<Typedef> TypedefVec;
+typedef std::pmr::vector<Struct> StructVec;
+typedef std::pmr::vector<Class> ClassVec;
 typedef std::vector<Score> ScoreVec;
 typedef std::vector<std::string> TokenVec;
+typedef std::vector<std::string> ArgVec;
 
 struct EntityAggregate {
     FunctionVec functions;
     TypedefVec typedefs;
     StructVec structs;
     ClassVec classes;
+
+    explicit EntityAggregate(const EntityAllocator& alloc = {})
+    : functions(alloc), typedefs(alloc), structs(alloc), classes(alloc) {}
+
+    /** Empties every vector and gives up its storage, keeping the allocator */
+    void clear() {
+        FunctionVec(functions.get_allocator()).swap(functions);
+        TypedefVec(typedefs.get_allocator()).swap(typedefs);
+        StructVec(structs.get_allocator()).swap(structs);
+        ClassVec(classes.get_allocator()).swap(classes);
+    }
 };
 
-template<typename T>
-typename T::value_type* last(T* container) {
-    return &*std::prev((*container).end());
-}
+enum EntityKind { kFunctions, kTypedefs, kStructs, kClasses, kEntityKinds };
 
-CXChildVisitResult cursorVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
-CXChildVisitResult functionDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
-CXChildVisitResult attributeDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
+/** Arena-backed string interner: equal strings share one copy and a dense 32-bit id */
+class StringInterner {
+public:
+    StringInterner() = default;
+    StringInterner(const StringInterner&) = delete;
+    StringInterner& operator=(const StringInterner&) = delete;
 
-void usage(char** argv) {
-    printf("USAGE: %s <srcfile> [-f|-t|-s|-c|-p] [query]\n", argv[0]);
-    printf("            srcfile : source or header file to search in\n");
-    printf("            -f      : search for functions\n");
-    printf("            -t      : search for typedefs\n");
-    printf("            -s      : search for structs\n");
-    printf("            -c      : search for classes\n");
-    printf("            -p      : don't query, just print everything\n");
-    printf("            query   : the query to search for\n");
-    printf("If no query is provided, just print\n");
-}
+    uint32_t intern(std::string_view s) {
+        auto it = ids.find(s);
+        if (it != ids.end()) return it->second;
+        std::string_view stored = store(s);
+        uint32_t id = views.size();
+        views.push_back(stored);
+        ids.emplace(stored, id);
+        return id;
+    }
 
-template<typename T>
-void printCX(const T& ts, const char* header="") {
-    printf("==================================\n");
-    printf("              %s           \n", header);
-    printf("==================================\n");
-    for (auto& t : ts) {
-        printf("%s %s\n", t.source.repr().c_str(), t.repr().c_str());
+    std::string_view str(uint32_t id) const { return views[id]; }
+    size_t size() const { return views.size(); }
+
+    /** Drops the lookup table once nothing more will be interned; ids and views stay valid */
+    void freeze() {
+        ids = std::unordered_map<std::string_view, uint32_t>();
+        views.shrink_to_fit();
     }
-    printf("\n");
-}
 
-CXChildVisitResult cursorVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
-    // skip included headers
-    if (clang_Location_isFromMainFile(clang_getCursorLocation(cursor)) == 0) {
-        return CXChildVisit_Continue;
+private:
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    std::string_view store(std::string_view s) {
+        if (s.empty()) return std::string_view();
+        if (s.size() > capacity - used) {
+            capacity = std::max(kChunkSize, s.size());
+            chunks.emplace_back(new char[capacity]);
+            used = 0;
+        }
+        char* at = chunks.back().get() + used;
+        memcpy(at, s.data(), s.size());
+        used += s.size();
+        return std::string_view(at, s.size());
     }
 
-    CXCursorKind cursor_kind = clang_getCursorKind(cursor);
-    CXString cursor_spelling = clang_getCursorSpelling(cursor);
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t used = 0;
+    size_t capacity = 0;
+    std::vector<std::string_view> views;
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
 
-    CXSourceLocation location = clang_getCursorLocation(cursor);
-    CXString filename;
-    unsigned int line, col;
-    clang_getPresumedLocation(location, &filename, &line, &col);
+/** SourceLoc as stored in an EntityStore, the filename pointing into the interner */
+struct StoredLoc {
+    std::string_view filename;
+    unsigned int line;
+    unsigned int col;
 
-    if (cursor_kind == CXCursor_FunctionDecl) {
-        CXType return_type = clang_getCursorResultType(cursor);
-        CXString return_spelling = clang_getTypeSpelling(return_type);
+    std::string repr() const {
+        return std::string(filename) + ":" + std::to_string(line) + ":" + std::to_string(col) + ":";
+    }
+};
 
-        ((EntityAggregate*)client_data)->functions.push_back(Function{
-            clang_getCString(filename), line, col,
-            clang_getCString(return_spelling),
-            clang_getCString(cursor_spelling)
-        });
+/** The { file id, line, col } columns every entity table has */
+class LocTable {
+public:
+    size_t size() const { return file_ids.size(); }
 
-        clang_visitChildren(cursor, *functionDeclVisitor, client_data);
+protected:
+    explicit LocTable(StringInterner* strings_) : strings(strings_) {}
 
-        return CXChildVisit_Continue;
+    void addLoc(const SourceLoc& source) {
+        file_ids.push_back(strings->intern(source.filename));
+        lines.push_back(source.line);
+        cols.push_back(source.col);
     }
-    else if (cursor_kind == CXCursor_TypedefDecl) {
-        CXString typedef_name = clang_getTypedefName(clang_getCursorType(cursor));
-        CXString typedef_type = clang_getTypeSpelling(clang_getTypedefDeclUnderlyingType(cursor));
 
-        ((EntityAggregate*)client_data)->typedefs.push_back(Typedef{
-            clang_getCString(filename), line, col,
-            clang_getCString(typedef_name),
-            clang_getCString(typedef_type)
-        });
+    StoredLoc loc(size_t i) const { return StoredLoc{ strings->str(file_ids[i]), lines[i], cols[i] }; }
 
-        return CXChildVisit_Continue;
+    void shrinkLocs() {
+        file_ids.shrink_to_fit();
+        lines.shrink_to_fit();
+        cols.shrink_to_fit();
     }
-    else if (cursor_kind == CXCursor_StructDecl) {
-        CXString struct_name = clang_getCursorSpelling(cursor);
 
-        ((EntityAggregate*)client_data)->structs.push_back(Struct {
-            clang_getCString(filename), line, col,
-            clang_getCString(struct_name)
-        });
+    StringInterner* strings;
+    std::vector<uint32_t> file_ids;
+    std::vector<uint32_t> lines;
+    std::vector<uint32_t> cols;
+};
+
+/** Functions, or class methods: arguments are ranges of the flat arg_names/arg_types */
+class FunctionTable : public LocTable {
+public:
+    struct Ref {
+        StoredLoc source;
+        std::string_view return_type;
+        std::string_view function_name;
+        const FunctionTable* table;
+        size_t row;
+
+        size_t arg_count() const { return table->arg_offsets[row + 1] - table->arg_offsets[row]; }
+        std::string_view arg_name(size_t k) const { return table->strings->str(table->arg_names[table->arg_offsets[row] + k]); }
+        std::string_view arg_type(size_t k) const { return table->strings->str(table->arg_types[table->arg_offsets[row] + k]); }
+        std::string_view normal() const { return table->strings->str(table->normals[row]); }
+        std::string repr() const { return std::string(function_name) + " :: " + std::string(normal()); }
+        std::string full_repr() const { return source.repr() + " " + repr(); }
+    };
 
-        clang_visitChildren(cursor, *attributeDeclVisitor, client_data);
+    explicit FunctionTable(StringInterner* strings_) : LocTable(strings_) {}
+
+    void add(const Function& fn) {
+        addLoc(fn.source);
+        return_types.push_back(strings->intern(fn.return_type));
+        names.push_back(strings->intern(fn.function_name));
+        normals.push_back(strings->intern(fn.normal()));
+        for (auto& arg : fn.args) {
+            arg_names.push_back(strings->intern(arg.arg_name));
+            arg_types.push_back(strings->intern(arg.arg_type));
+        }
+        arg_offsets.push_back(arg_names.size());
     }
-    else if (cursor_kind == CXCursor_ClassDecl) {
-        CXString class_name = clang_getCursorSpelling(cursor);
 
-        ((EntityAggregate*)client_data)->classes.push_back(Class {
-            clang_getCString(filename), line, col,
-            clang_getCString(class_name)
-        });
+    Ref operator[](size_t i) const {
+        return Ref{ loc(i), strings->str(return_types[i]), strings->str(names[i]), this, i };
+    }
 
-        clang_visitChildren(cursor, *attributeDeclVisitor, client_data);
-        clang_visitChildren(cursor, *functionDeclVisitor, client_data);
+    void shrink() {
+        shrinkLocs();
+        for (auto* column : { &return_types, &names, &normals, &arg_offsets, &arg_names, &arg_types }) {
+            column->shrink_to_fit();
+        }
     }
 
-    return CXChildVisit_Recurse;
-}
+private:
+    std::vector<uint32_t> return_types;
+    std::vector<uint32_t> names;
+    std::vector<uint32_t> normals;   // normal() is what gets scored, so it is interned too
+    std::vector<uint32_t> arg_offsets{ 0 };
+    std::vector<uint32_t> arg_names;
+    std::vector<uint32_t> arg_types;
+};
 
-CXChildVisitResult functionDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
-    CXCursorKind kind = clang_getCursorKind(cursor);
-    CXType type = clang_getCursorType(cursor);
+class TypedefTable : public LocTable {
+public:
+    struct Ref {
+        StoredLoc source;
+        std::string_view alias;
+        std::string_view aliased;
 
-    if (kind == CXCursor_ParmDecl) {
-        CXString param_name = clang_getCursorSpelling(cursor);
-        CXString param_type = clang_getTypeSpelling(type);
+        std::string repr() const { return std::string(alias) + " :: " + std::string(aliased); }
+        std::string_view normal() const { return alias; }
+    };
 
-        Function* fn = last(&((EntityAggregate*)client_data)->functions);
-        fn->add_arg(clang_getCString(param_name), clang_getCString(param_type));
+    explicit TypedefTable(StringInterner* strings_) : LocTable(strings_) {}
+
+    void add(const Typedef& t) {
+        addLoc(t.source);
+        aliases.push_back(strings->intern(t.alias));
+        aliaseds.push_back(strings->intern(t.aliased));
     }
 
-    return CXChildVisit_Continue;
-}
+    Ref operator[](size_t i) const {
+        return Ref{ loc(i), strings->str(aliases[i]), strings->str(aliaseds[i]) };
+    }
 
-CXChildVisitResult attributeDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
-    CXCursorKind kind = clang_getCursorKind(cursor);
-    CXType type = clang_getCursorType(cursor);
+    void shrink() {
+        shrinkLocs();
+        aliases.shrink_to_fit();
+        aliaseds.shrink_to_fit();
+    }
 
-    if (kind == CXCursor_FieldDecl) {
-        CXString attr_name = clang_getCursorSpelling(cursor);
-        CXString attr_type = clang_getTypeSpelling(type);
+private:
+    std::vector<uint32_t> aliases;
+    std::vector<uint32_t> aliaseds;
+};
+
+/** Structs and classes: attributes are ranges of the flat attr_names/attr_types */
+class RecordTable : public LocTable {
+protected:
+    explicit RecordTable(StringInterner* strings_) : LocTable(strings_) {}
 
-        Struct* fn = last(&((EntityAggregate*)client_data)->structs);
-        fn->add_attr(clang_getCString(attr_name), clang_getCString(attr_type));
+    void addRecord(std::string_view name, const std::pmr::vector<Attribute>& attributes) {
+        names.push_back(strings->intern(name));
+        for (auto& attr : attributes) {
+            attr_names.push_back(strings->intern(attr.attr_name));
+            attr_types.push_back(strings->intern(attr.attr_type));
+        }
+        attr_offsets.push_back(attr_names.size());
     }
 
-    return CXChildVisit_Continue;
-}
+    void shrinkRecords() {
+        shrinkLocs();
+        for (auto* column : { &names, &attr_offsets, &attr_names, &attr_types }) {
+            column->shrink_to_fit();
+        }
+    }
 
-template<typename... Ts>
-auto min(Ts... ts) {
-    return std::min({std::forward<Ts>(ts)...});
-}
+    std::string attributesRepr(size_t i) const {
+        std::string representation;
+        for (uint32_t a = attr_offsets[i]; a < attr_offsets[i + 1]; ++a) {
+            if (a > attr_offsets[i]) representation += ", ";
+            representation += std::string(strings->str(attr_names[a])) + " :: " + std::string(strings->str(attr_types[a]));
+        }
+        return representation;
+    }
+
+    std::vector<uint32_t> names;
+    std::vector<uint32_t> attr_offsets{ 0 };
+    std::vector<uint32_t> attr_names;
+    std::vector<uint32_t> attr_types;
+};
 
-/** Calculate the Levenshtein distance */
-int lev(std::string_view a, std::string_view b) {
-    int n = a.size();
-    int m = b.size();
-    int distance[n+1][m+1];
-    std::memset(distance, 0, sizeof(int)*(n+1)*(m+1));
+class StructTable : public RecordTable {
+public:
+    struct Ref {
+        StoredLoc source;
+        std::string_view struct_name;
+        const StructTable* table;
+        size_t row;
 
-    // initialize first row and first column
-    for (int i = 0; i < n+1; ++i) { distance[i][0] = i; }
-    for (int j = 0; j < m+1; ++j) { distance[0][j] = j; }
+        std::string repr() const { return std::string(struct_name) + " { " + table->attributesRepr(row) + " }"; }
+        std::string_view normal() const { return struct_name; }
+        size_t attr_count() const { return table->attr_offsets[row + 1] - table->attr_offsets[row]; }
+        std::string_view attr_name(size_t k) const { return table->strings->str(table->attr_names[table->attr_offsets[row] + k]); }
+        std::string_view attr_type(size_t k) const { return table->strings->str(table->attr_types[table->attr_offsets[row] + k]); }
+    };
 
-    // calculate the rest of the matrix
-    for (int i = 1; i < n+1; ++i) {
-        for (int j = 1; j < m+1; ++j) {
-            if (a[i-1] == b[j-1]) {
-                distance[i][j] = distance[i-1][j-1];
-            } else {
-                distance[i][j] = min(distance[i  ][j-1],
-                                     distance[i-1][j  ],
-                                     distance[i-1][j-1]) + 1;
+    explicit StructTable(StringInterner* strings_) : RecordTable(strings_) {}
+
+    void add(const Struct& s) {
+        addLoc(s.source);
+        addRecord(s.struct_name, s.attributes);
+    }
+
+    Ref operator[](size_t i) const { return Ref{ loc(i), strings->str(names[i]), this, i }; }
+
+    void shrink() { shrinkRecords(); }
+};
+
+class ClassTable : public RecordTable {
+public:
+    struct Ref {
+        StoredLoc source;
+        std::string_view class_name;
+        const ClassTable* table;
+        size_t row;
+
+        std::string repr() const {
+            std::string representation = std::string(class_name) + " { " + table->attributesRepr(row);
+            for (uint32_t m = table->method_offsets[row]; m < table->method_offsets[row + 1]; ++m) {
+                if (m > table->method_offsets[row]) representation += ", ";
+                representation += table->methods[m].repr();
             }
+            return representation + " }";
         }
+        std::string_view normal() const { return class_name; }
+        size_t attr_count() const { return table->attr_offsets[row + 1] - table->attr_offsets[row]; }
+        std::string_view attr_name(size_t k) const { return table->strings->str(table->attr_names[table->attr_offsets[row] + k]); }
+        std::string_view attr_type(size_t k) const { return table->strings->str(table->attr_types[table->attr_offsets[row] + k]); }
+        size_t method_count() const { return table->method_offsets[row + 1] - table->method_offsets[row]; }
+        FunctionTable::Ref method(size_t k) const { return table->methods[table->method_offsets[row] + k]; }
+    };
+
+    explicit ClassTable(StringInterner* strings_) : RecordTable(strings_), methods(strings_) {}
+
+    void add(const Class& c) {
+        addLoc(c.source);
+        addRecord(c.class_name, c.attributes);
+        for (auto& method : c.methods) methods.add(method);
+        method_offsets.push_back(methods.size());
     }
 
-    // answer is the last element
-    return distance[n][m];
-}
+    Ref operator[](size_t i) const { return Ref{ loc(i), strings->str(names[i]), this, i }; }
 
-ScoreVec getScores(const FunctionVec& functions, const std::string& query) {
-    ScoreVec scores;
-    scores.reserve(functions.size());
-    for(auto& fn : functions) {
-        scores.push_back({ fn.full_repr(), lev(fn.normal(), query) });
+    void shrink() {
+        shrinkRecords();
+        methods.shrink();
+        method_offsets.shrink_to_fit();
     }
-    return scores;
-}
 
-template<typename T>
-ScoreVec getScores(const T& ts, const std::string& query) {
-    ScoreVec scores;
-    scores.reserve(ts.size());
-    for(auto& t : ts) {
-        scores.push_back({ t.repr(), lev(t.normal(), query) });
+private:
+    FunctionTable methods;
+    std::vector<uint32_t> method_offsets{ 0 };
+};
+
+/**
+ * Struct-of-arrays copy of the entities for searching. Strings are interned
+ * once, so a filename or "int" shared by thousands of entities is stored
+ * once, and scans read dense id columns instead of chasing heap strings.
+ * Rows are read through small Ref views with the same field names as the
+ * entity structs, so the search templates work on either.
+ */
+class EntityStore {
+public:
+    EntityStore() : functions(&strings), typedefs(&strings), structs(&strings), classes(&strings) {}
+    EntityStore(const EntityStore&) = delete;
+    EntityStore& operator=(const EntityStore&) = delete;
+
+    /** Appends the entities in order and frees them */
+    void add(EntityAggregate&& entities) {
+        for (auto& fn : entities.functions) functions.add(fn);
+        for (auto& t : entities.typedefs) typedefs.add(t);
+        for (auto& s : entities.structs) structs.add(s);
+        for (auto& c : entities.classes) classes.add(c);
+        entities.clear();
     }
-    return scores;
-}
 
-std::string bestMatch(const ScoreVec& scores) {
-    return (*std::min_element(scores.begin(), scores.end(),
-                [](auto& a, auto& b){ return a.score < b.score; })
-            ).id;
+    /** Releases lookup tables and spare capacity; call once everything is added */
+    void seal() {
+        strings.freeze();
+        functions.shrink();
+        typedefs.shrink();
+        structs.shrink();
+        classes.shrink();
+    }
+
+    StringInterner strings;
+    FunctionTable functions;
+    TypedefTable typedefs;
+    StructTable structs;
+    ClassTable classes;
+};
+
+struct SourceFile {
+    std::string filename;
+    size_t flags;   // index into Project::flag_sets
+};
+
+struct Project {
+    std::vector<SourceFile> sources;
+    std::vector<ArgVec> flag_sets{ ArgVec{} };
+
+    /** Identical command lines share one flag set */
+    size_t internFlags(ArgVec&& args) {
+        auto it = std::find(flag_sets.begin(), flag_sets.end(), args);
+        if (it != flag_sets.end()) {
+            return it - flag_sets.begin();
+        }
+        flag_sets.push_back(std::move(args));
+        return flag_sets.size() - 1;
+    }
+};
+
+/** Identifies one version of a file: mtime is checked first, the hash only when it moved */
+struct FileStamp {
+    std::string filename;
+    int64_t mtime = 0;      // nanoseconds
+    uint64_t hash = 0;      // FNV-1a of the contents
+};
+
+/**
+ * A translation unit and what was collected from it. The entities live in
+ * the unit's own monotonic arena, declared first so it outlives them, and
+ * releaseEntities() frees them all at once. Units can be moved around but
+ * not move-assigned, since pmr containers don't take their allocator along
+ * on assignment.
+ */
+struct IndexUnit {
+    static constexpr size_t kArenaChunk = 64 * 1024;
+
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena =
+        std::make_unique<std::pmr::monotonic_buffer_resource>(kArenaChunk);
+    FileStamp source;
+    ArgVec flags;
+    std::vector<FileStamp> deps;    // headers pulled in by the TU
+    std::vector<std::string> claimed;   // header keys whose entities this unit collected
+    EntityAggregate entities{ EntityAllocator(arena.get()) };
+
+    IndexUnit() = default;
+    IndexUnit(IndexUnit&&) = default;
+    IndexUnit& operator=(IndexUnit&&) = delete;
+
+    void releaseEntities() {
+        entities.clear();
+        arena->release();
+    }
+};
+
+/**
+ * Counters behind --stats. Each thread bumps its own copy with plain
+ * increments, no atomics or locks, and adds it to the process totals once,
+ * when it exits, so they're cheap enough to always be on.
+ */
+struct StatCounters {
+    uint64_t cursors = 0;           // cursors the visitor looked at
+    uint64_t entities = 0;          // functions, typedefs, structs and classes collected
+    uint64_t lev_calls = 0;         // candidates scored by an edit distance kernel
+    uint64_t dp_cells = 0;          // DP cells those kernels computed
+    uint64_t range_candidates = 0;  // entities range searches had to consider
+    uint64_t range_evaluations = 0; // distances they evaluated, fewer with a BK-tree
+    uint64_t parse_ns = 0;          // thread CPU time spent in libclang parsing
+    uint64_t collect_ns = 0;        // thread CPU time spent walking cursors
+    uint64_t bytes_allocated = 0;   // by operator new, libclang's allocations included
+
+    void add(const StatCounters& other) {
+        cursors += other.cursors;
+        entities += other.entities;
+        lev_calls += other.lev_calls;
+        dp_cells += other.dp_cells;
+        range_candidates += other.range_candidates;
+        range_evaluations += other.range_evaluations;
+        parse_ns += other.parse_ns;
+        collect_ns += other.collect_ns;
+        bytes_allocated += other.bytes_allocated;
+    }
+};
+
+// kept apart from StatCounters: operator new can run while a thread's ThreadStats is
+// being created or destroyed, and a trivially destructible thread_local is always there
+thread_local uint64_t thread_bytes_allocated = 0;
+
+class ThreadStats {
+public:
+    ~ThreadStats() {
+        counters.bytes_allocated = thread_bytes_allocated;
+        thread_bytes_allocated = 0;
+        std::lock_guard<std::mutex> lock(totalsMutex());
+        totals().add(counters);
+    }
+
+    static StatCounters& local() {
+        thread_local ThreadStats stats;
+        return stats.counters;
+    }
+
+    /** Counts of the threads that exited plus the calling one */
+    static StatCounters total() {
+        StatCounters sum;
+        {
+            std::lock_guard<std::mutex> lock(totalsMutex());
+            sum = totals();
+        }
+        sum.add(local());
+        sum.bytes_allocated += thread_bytes_allocated;
+        return sum;
+    }
+
+private:
+    static std::mutex& totalsMutex() { static std::mutex mutex; return mutex; }
+    static StatCounters& totals() { static StatCounters counters; return counters; }
+
+    StatCounters counters;
+};
+
+/** Every replaced operator new allocates here, counting the bytes, and every delete frees through releaseCounted */
+void* allocateCounted(size_t size, size_t alignment) {
+    thread_bytes_allocated += size;
+    void* p = NULL;
+    if (alignment <= alignof(std::max_align_t)) p = malloc(size != 0 ? size : 1);
+    else if (posix_memalign(&p, std::max(sizeof(void*), alignment), size != 0 ? size : 1) != 0) p = NULL;
+    if (p == NULL) throw std::bad_alloc();
+    return p;
 }
 
-void sortScores(ScoreVec& scores) {
-    std::sort(scores.begin(), scores.end(),
-        [](auto& a, auto& b){ return a.score < b.score; });
+void releaseCounted(void* p) noexcept { free(p); }
+
+void* operator new(size_t size) { return allocateCounted(size, 0); }
+void* operator new(size_t size, std::align_val_t align) { return allocateCounted(size, (size_t)align); }
+
+// GCC takes operator new for the builtin one and warns about the free() it sees inlined into
+// deletes (-Wmismatched-new-delete at -O1); the replacements do pair up through the helpers above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { releaseCounted(p); }
+void operator delete(void* p, size_t) noexcept { releaseCounted(p); }
+void operator delete(void* p, std::align_val_t) noexcept { releaseCounted(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { releaseCounted(p); }
+#pragma GCC diagnostic pop
+
+uint64_t threadCpuNs() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
 }
 
-TokenVec tokenizeQuery(std::string& query) {
-    TokenVec tokens;
+/** Wall and CPU time of the top-level phases of a run, marked from the main thread */
+class PhaseLog {
+public:
+    PhaseLog() { restart(); }
 
-    stb_lexer lexer;
-    char string_storage[1024];
-    // void stb_c_lexer_init(stb_lexer *lexer,
-    //                       const char *input_stream,
-    //                       const char *input_stream_end,
-    //                       char *string_store,
-    //                       int store_length);
-    stb_c_lexer_init(&lexer, query.c_str(), query.c_str() + query.size(), string_storage, 1024);
+    /** Close the phase running since the previous mark, calling it name */
+    void mark(const char* name) {
+        auto wall = std::chrono::steady_clock::now();
+        timespec cpu;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+        double cpu_seconds = cpu.tv_sec + cpu.tv_nsec * 1e-9;
+        phases.push_back({ name, std::chrono::duration<double>(wall - wall_start).count(), cpu_seconds - cpu_start });
+        restart();
+    }
 
-    while (stb_c_lexer_get_token(&lexer)) {
-        if (lexer.token < CLEX_eof) {
-            tokens.push_back(std::string(1, (char)lexer.token));
+    /** Skip the time since the previous mark */
+    void restart() {
+        wall_start = std::chrono::steady_clock::now();
+        timespec cpu;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+        cpu_start = cpu.tv_sec + cpu.tv_nsec * 1e-9;
+    }
+
+    void report() const {
+        fprintf(stderr, "%-16s %10s %10s\n", "phase", "wall", "cpu");
+        for (auto& phase : phases) {
+            fprintf(stderr, "%-16s %9.3fs %9.3fs\n", phase.name, phase.wall, phase.cpu);
         }
-        else if (lexer.token == CLEX_id) {
-            tokens.push_back(std::string(lexer.string));
+
+        StatCounters total = ThreadStats::total();
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stderr, "libclang parse   %9.3fs cpu, cursor walk %.3fs cpu\n",
+                total.parse_ns * 1e-9, total.collect_ns * 1e-9);
+        fprintf(stderr, "cursors visited  %llu, entities collected %llu\n",
+                (unsigned long long)total.cursors, (unsigned long long)total.entities);
+        fprintf(stderr, "edit distances   %llu, DP cells %llu\n",
+                (unsigned long long)total.lev_calls, (unsigned long long)total.dp_cells);
+        if (total.range_candidates > 0) {
+            fprintf(stderr, "range searches   %llu distance evaluations for %llu candidates\n",
+                    (unsigned long long)total.range_evaluations, (unsigned long long)total.range_candidates);
         }
+        fprintf(stderr, "allocated        %.1f MB, peak RSS %.1f MB\n",
+                total.bytes_allocated / 1e6, usage.ru_maxrss / 1024.0);
     }
 
-    return tokens;
+private:
+    struct Phase {
+        const char* name;
+        double wall;
+        double cpu;
+    };
+
+    std::vector<Phase> phases;
+    std::chrono::steady_clock::time_point wall_start;
+    double cpu_start = 0;
+};
+
+PhaseLog& phaseLog() {
+    static PhaseLog log;
+    return log;
 }
 
-std::string normalizeQuery(TokenVec&& tokens) {
-    std::string normalized_query;
-    for (auto& tok : tokens) {
-        normalized_query += tok + " ";
+/** Owns a CXString and disposes it at the end of the scope */
+class ScopedCXString {
+public:
+    explicit ScopedCXString(CXString string_) : string(string_) {}
+    ~ScopedCXString() { clang_disposeString(string); }
+    ScopedCXString(const ScopedCXString&) = delete;
+    ScopedCXString& operator=(const ScopedCXString&) = delete;
+
+    const char* c_str() const {
+        const char* s = clang_getCString(string);
+        return s != NULL ? s : "";
     }
-    return normalized_query;
+
+private:
+    CXString string;
+};
+
+/**
+ * Project-wide record of which headers were already collected. A header is
+ * keyed on its path and the macros of the unit including it, so the first
+ * unit to claim a key collects its entities and every other one skips them.
+ */
+class HeaderClaims {
+public:
+    /** True if key was free, and is now owned by the caller */
+    bool claim(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return keys.insert(key).second;
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_set<std::string> keys;
+};
+
+/** What cursorVisitor collects into, and which headers it may collect from */
+struct VisitContext {
+    EntityAggregate* entities = NULL;
+    HeaderClaims* claims = NULL;            // NULL: collect the main file only
+    std::string macro_key;
+    std::vector<std::string>* claimed = NULL;
+    std::unordered_map<CXFile, bool> owned; // claim decisions of this unit, by file
+};
+
+CXChildVisitResult cursorVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
+CXChildVisitResult functionDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
+CXChildVisitResult attributeDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
+CXChildVisitResult classDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data);
+
+void usage(char** argv) {
+    printf("USAGE: %s <srcfile>... [-j N] [-f|-t|-s|-c|-u|-p] [query]\n", argv[0]);
+    printf("       %s index [-o indexfile] <srcfile>... [-j N]\n", argv[0]);
+    printf("       %s update -i indexfile [-o indexfile] [srcfile]... [-j N]\n", argv[0]);
+    printf("       %s -i indexfile [-f|-t|-s|-c|-u|-p] [query]\n", argv[0]);
+    printf("       %s serve [-i indexfile | srcfile...] [--socket path]\n", argv[0]);
+    printf("       %s query [--socket path] -f|-t|-s|-c|-u query\n", argv[0]);
+    printf("       %s bench [--files N] [--functions N] [--structs N] [--typedef-depth N]\n", argv[0]);
+    printf("                [--templates N] [--queries N]\n");
+    printf("            srcfile : source or header file to search in, a directory\n");
+    printf("                      (searched recursively), a glob or @listfile\n");
+    printf("            -j N    : number of parser and scoring threads (default: all cores)\n");
+    printf("            --compdb path : directory containing compile_commands.json;\n");
+    printf("                      sources are parsed with their recorded flags and\n");
+    printf("                      every entry is indexed if no srcfile is given\n");
+    printf("            --pch   : precompile the system headers that sources with the same\n");
+    printf("                      flags all start with, once, instead of once per source\n");
+    printf("            --headers : also collect project headers, each one by the first\n");
+    printf("                      source including it with the same macros\n");
+    printf("            --parse decls|full : skip function bodies and keep going past errors\n");
+    printf("                      (default), or parse everything like a compiler\n");
+    printf("            --engine visitor|indexer : walk the whole AST (default), or let\n");
+    printf("                      clang_indexSourceFile report just the declarations\n");
+    printf("            index   : parse the sources and save their entities to indexfile\n");
+    printf("                      (default: seapeapea.idx)\n");
+    printf("            update  : re-parse only the translation units of indexfile whose\n");
+    printf("                      source or included headers changed; given srcfiles\n");
+    printf("                      replace the indexed set, and --parse, --engine or\n");
+    printf("                      --headers other than the index's re-parse all of them\n");
+    printf("            serve   : keep the entities in memory and answer queries on a Unix\n");
+    printf("                      socket (default: seapeapea.sock) with JSON, until killed\n");
+    printf("            query   : ask a running server; prints its JSON response\n");
+    printf("            bench   : time every phase on a generated project of the given size\n");
+    printf("                      and print the results as JSON\n");
+    printf("            -i      : search a saved index instead of parsing sources\n");
+    printf("            -f      : search for functions\n");
+    printf("            -t      : search for typedefs\n");
+    printf("            -s      : search for structs\n");
+    printf("            -c      : search for classes\n");
+    printf("            -u      : search for functions by signature, e.g. 'int (char *, size_t)';\n");
+    printf("                      arguments may come in any order, typedefs are expanded,\n");
+    printf("                      const and pointers are relaxed and _ matches any type\n");
+    printf("            -p      : don't query, just print everything\n");
+    printf("            --batch file : answer the queries in file (- for stdin), one\n");
+    printf("                      '<mode> <query>' per line, and report queries/s\n");
+    printf("            -n N    : number of matches to show (default: 10)\n");
+    printf("            --max-distance N : show every match within edit distance N\n");
+    printf("            --scorer auto|simd|bitparallel : distance kernel for full scans\n");
+    printf("            --tokens : score by edits of whole tokens instead of characters\n");
+    printf("            --format text|jsonl|tsv : print entities and matches as text (default),\n");
+    printf("                      one JSON object per line, or tab separated fields\n");
+    printf("            --stats : report time per phase, cursors, edit distances, DP cells,\n");
+    printf("                      allocations and peak memory on stderr\n");
+    printf("            query   : the query to search for\n");
+    printf("If no query is provided, just print\n");
 }
 
-int main(int argc, char** argv) {
-    if (argc < 4) {
-        usage(argv);
-        return 0;
+bool writeAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = write(fd, data.data(), data.size());
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data.remove_prefix(written);
     }
+    return true;
+}
 
-    std::string filename(argv[1]);
-    std::string mode(argv[2]);
-    std::string query(argv[3]);
+enum class OutputFormat { Text, Jsonl, Tsv };
 
-    CXIndex index = clang_createIndex(0, 0);
-    if (index == 0) {
-        fprintf(stderr, "ERROR: clang_createIndex() failed\n");
-        return 1;
+/** Passes s to emit in pieces that make up the inside of a JSON string literal */
+template<typename Emit>
+void escapeJson(std::string_view s, Emit emit) {
+    size_t start = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = s[i];
+        if (c != '"' && c != '\\' && c >= 0x20) continue;
+        emit(s.substr(start, i - start));
+        char escape[8];
+        if (c == '"' || c == '\\') snprintf(escape, sizeof(escape), "\\%c", c);
+        else snprintf(escape, sizeof(escape), "\\u%04x", c);
+        emit(std::string_view(escape));
+        start = i + 1;
     }
+    emit(s.substr(start));
+}
 
-    // clang_parseTranslationUnit(CXIndex CIdx,
-    //                        const char *source_filename,
-    //                        const char *const *command_line_args,
-    //                        int num_command_line_args,
-    //                        struct CXUnsavedFile *unsaved_files,
-    //                        unsigned num_unsaved_files,
-    //                        unsigned options);
-    CXTranslationUnit translation_unit = clang_parseTranslationUnit(
-        index, filename.c_str(), NULL, 0, NULL, 0, CXTranslationUnit_None);
-    if (translation_unit == 0) {
-        fprintf(stderr, "ERROR: clang_parseTranslationUnit() failed\n");
+/**
+ * Buffered writer for everything printed on stdout. Entities are formatted
+ * field by field straight into one large buffer, numbers with to_chars, and
+ * the buffer goes out with a single write() whenever it fills up.
+ *
+ * Text is the human readable output. JSON Lines gives one object per entity
+ * or match; TSV gives one row of kind, file, line, col, name and details,
+ * with tabs and newlines inside values turned into spaces. A match is the
+ * same record preceded by its score, and by the mode and query in batches.
+ */
+class OutputWriter {
+public:
+    static constexpr size_t kBufferSize = 1 << 20;
+
+    explicit OutputWriter(OutputFormat format_ = OutputFormat::Text, int fd_ = STDOUT_FILENO)
+    : format(format_), fd(fd_), buffer(new char[kBufferSize]) {
+        fflush(stdout);     // anything printf'ed before goes first
     }
+    ~OutputWriter() { flush(); }
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
 
-    CXCursor root_cursor = clang_getTranslationUnitCursor(translation_unit);
+    OutputFormat outputFormat() const { return format; }
 
-    EntityAggregate entities;
-    unsigned int res = clang_visitChildren(root_cursor, *cursorVisitor, (CXClientData*)&entities);
+    /** Title of a group of lines, text only */
+    void banner(std::string_view title) {
+        if (format != OutputFormat::Text) return;
+        raw("======== ");
+        raw(title);
+        raw(" ========\n");
+    }
 
-    if (mode == "-p") {
-        printCX(entities.functions, "FUNCTIONS");
-        printCX(entities.typedefs, "TYPEDEFS");
-        printCX(entities.structs, "STRUCTS");
-        printCX(entities.classes, "CLASSES");
+    /** Header of a -p section, text only */
+    void section(std::string_view title) {
+        if (format != OutputFormat::Text) return;
+        raw("==================================\n              ");
+        raw(title);
+        raw("           \n==================================\n");
     }
-    else {
-        std::string normalized_query = normalizeQuery(tokenizeQuery(query));
 
-        ScoreVec scores;
-        if (mode == "-f")      { scores = getScores(entities.functions, normalized_query); }
-        else if (mode == "-t") { scores = getScores(entities.typedefs, normalized_query); }
-        else if (mode == "-s") { scores = getScores(entities.structs, normalized_query); }
-        else if (mode == "-c") { scores = getScores(entities.classes, normalized_query); }
+    void endSection() {
+        if (format == OutputFormat::Text) raw("\n");
+    }
 
-        sortScores(scores);
-        printf("======== Best matches ========\n");
-        for (size_t i = 0; i < std::min((size_t)10, scores.size()); ++i) {
-            printf("%s\n", scores[i].id.c_str());
+    /** An entity as -p lists it */
+    template<typename Ref>
+    void entity(const Ref& ref) {
+        if (format == OutputFormat::Jsonl) raw("{");
+        record(ref, true);
+    }
+
+    /**
+     * A search result: the entity after its score, and after mode and query if
+     * given, for batches. Text keeps the original layout, where only functions
+     * show their location.
+     */
+    template<typename Ref>
+    void match(const Ref& ref, int score, std::string_view mode = {}, std::string_view query = {}) {
+        if (format == OutputFormat::Tsv) {
+            if (!mode.empty()) { value(mode); raw("\t"); value(query); raw("\t"); }
+            number(score);
+            raw("\t");
         }
-        // printf("%s\n", bestMatch(scores).c_str());
+        else if (format == OutputFormat::Jsonl) {
+            raw("{");
+            if (!mode.empty()) { key("mode"); json(mode); raw(","); key("query"); json(query); raw(","); }
+            key("score"); number(score);
+            raw(",");
+        }
+        record(ref, std::is_same_v<Ref, FunctionTable::Ref>);
     }
 
-    clang_disposeTranslationUnit(translation_unit);
-    clang_disposeIndex(index);
+    void flush() {
+        writeAll(fd, std::string_view(buffer.get(), used));
+        written += used;
+        used = 0;
+    }
+
+    /** Bytes written so far, buffered ones included */
+    size_t bytes() const { return written + used; }
+
+private:
+    /** One entity in the current format; a JSON object is already open */
+    void record(const FunctionTable::Ref& fn, bool located) {
+        begin("function", fn.source, fn.function_name, located);
+        if (format == OutputFormat::Jsonl) {
+            function(fn);
+            raw("}\n");
+            return;
+        }
+        if (format == OutputFormat::Text) raw(" :: ");
+        value(fn.normal());
+        raw("\n");
+    }
 
-    return 0;
-}
\ No newline at end of file
+    void record(const TypedefTable::Ref& t, bool located) {
+        begin("typedef", t.source, t.alias, located);
+        if (format == OutputFormat::Jsonl) {
+            raw(","); key("type"); json(t.aliased);
+            raw("}\n");
+            return;
+        }
+        if (format == OutputFormat::Text) raw(" :: ");
+        value(t.aliased);
+        raw("\n");
+    }
+
+    void record(const StructTable::Ref& st, bool located) {
+        begin("struct", st.source, st.struct_name, located);
+        if (format == OutputFormat::Jsonl) {
+            raw(","); fields(st);
+            raw("}\n");
+            return;
+        }
+        if (format == OutputFormat::Text) raw(" { ");
+        members(st);
+        if (format == OutputFormat::Text) raw(" }");
+        raw("\n");
+    }
+
+    void record(const ClassTable::Ref& cl, bool located) {
+        begin("class", cl.source, cl.class_name, located);
+        if (format == OutputFormat::Jsonl) {
+            raw(","); fields(cl);
+            raw(","); key("methods"); raw("[");
+            for (size_t m = 0; m < cl.method_count(); ++m) {
+                FunctionTable::Ref method = cl.method(m);
+                if (m > 0) raw(",");
+                raw("{"); key("line"); number(method.source.line);
+                raw(","); key("col"); number(method.source.col);
+                raw(","); key("name"); json(method.function_name);
+                function(method);
+                raw("}");
+            }
+            raw("]}\n");
+            return;
+        }
+        if (format == OutputFormat::Text) raw(" { ");
+        members(cl);
+        // text matches Class::repr(), where methods follow the fields without a separator
+        bool separate = format == OutputFormat::Tsv && cl.attr_count() > 0;
+        for (size_t m = 0; m < cl.method_count(); ++m) {
+            FunctionTable::Ref method = cl.method(m);
+            if (m > 0 || separate) raw(", ");
+            value(method.function_name);
+            raw(" :: ");
+            value(method.normal());
+        }
+        if (format == OutputFormat::Text) raw(" }");
+        raw("\n");
+    }
+
+    void raw(std::string_view s) {
+        if (s.size() > kBufferSize - used) {
+            flush();
+            if (s.size() > kBufferSize) {
+                writeAll(fd, s);
+                written += s.size();
+                return;
+            }
+        }
+        memcpy(buffer.get() + used, s.data(), s.size());
+        used += s.size();
+    }
+
+    void number(int64_t n) {
+        if (kBufferSize - used < 24) flush();
+        char* end = std::to_chars(buffer.get() + used, buffer.get() + kBufferSize, n).ptr;
+        used = end - buffer.get();
+    }
+
+    /** A value in the current format: as is for text, without tabs and newlines for TSV */
+    void value(std::string_view s) {
+        if (format != OutputFormat::Tsv) {
+            raw(s);
+            return;
+        }
+        size_t start = 0;
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] == '\t' || s[i] == '\n' || s[i] == '\r') {
+                raw(s.substr(start, i - start));
+                raw(" ");
+                start = i + 1;
+            }
+        }
+        raw(s.substr(start));
+    }
+
+    void json(std::string_view s) {
+        raw("\"");
+        escapeJson(s, [this](std::string_view piece) { raw(piece); });
+        raw("\"");
+    }
+
+    void key(const char* name) {
+        raw("\"");
+        raw(name);
+        raw("\":");
+    }
+
+    /** Location and name: "file:line:col: name", a TSV row start or JSON fields; text skips the location unless located */
+    void begin(const char* kind, const StoredLoc& source, std::string_view name, bool located) {
+        if (format == OutputFormat::Jsonl) {
+            key("kind"); json(kind);
+            raw(","); key("file"); json(source.filename);
+            raw(","); key("line"); number(source.line);
+            raw(","); key("col"); number(source.col);
+            raw(","); key("name"); json(name);
+            return;
+        }
+        if (format == OutputFormat::Text && !located) {
+            value(name);
+            return;
+        }
+        const char* separator = ":";
+        if (format == OutputFormat::Tsv) {
+            raw(kind);
+            raw("\t");
+            separator = "\t";
+        }
+        value(source.filename);
+        raw(separator);
+        number(source.line);
+        raw(separator);
+        number(source.col);
+        raw(format == OutputFormat::Tsv ? "\t" : ": ");
+        value(name);
+        if (format == OutputFormat::Tsv) raw("\t");
+    }
+
+    /** Return type and arguments, continuing a JSON object */
+    void function(const FunctionTable::Ref& fn) {
+        raw(","); key("return_type"); json(fn.return_type);
+        raw(","); key("args"); raw("[");
+        for (size_t a = 0; a < fn.arg_count(); ++a) {
+            if (a > 0) raw(",");
+            raw("{"); key("name"); json(fn.arg_name(a));
+            raw(","); key("type"); json(fn.arg_type(a));
+            raw("}");
+        }
+        raw("]");
+    }
+
+    template<typename Record>
+    void fields(const Record& record) {
+        key("fields");
+        raw("[");
+        for (size_t a = 0; a < record.attr_count(); ++a) {
+            if (a > 0) raw(",");
+            raw("{"); key("name"); json(record.attr_name(a));
+            raw(","); key("type"); json(record.attr_type(a));
+            raw("}");
+        }
+        raw("]");
+    }
+
+    /** "name :: type, ..." as in repr() */
+    template<typename Record>
+    void members(const Record& record) {
+        for (size_t a = 0; a < record.attr_count(); ++a) {
+            if (a > 0) raw(", ");
+            value(record.attr_name(a));
+            raw(" :: ");
+            value(record.attr_type(a));
+        }
+    }
+
+    OutputFormat format;
+    int fd;
+    std::unique_ptr<char[]> buffer;
+    size_t written = 0;
+    size_t used = 0;
+};
+
+template<typename T>
+void printCX(OutputWriter& out, const T& ts, const char* header="") {
+    out.section(header);
+    for (size_t i = 0; i < ts.size(); ++i) {
+        out.entity(ts[i]);
+    }
+    out.endSection();
+}
+
+/** The scores of a query in mode, from its entity table; batches pass query to repeat both on every line */
+void writeMatches(OutputWriter& out, const EntityStore& entities, const std::string& mode, const ScoreVec& scores,
+                  const std::string* query = NULL) {
+    std::string_view echo_mode = query != NULL ? std::string_view(mode) : std::string_view();
+    std::string_view echo_query = query != NULL ? std::string_view(*query) : std::string_view();
+    for (auto& score : scores) {
+        if (mode == "-t")      out.match(entities.typedefs[score.index], score.score, echo_mode, echo_query);
+        else if (mode == "-s") out.match(entities.structs[score.index], score.score, echo_mode, echo_query);
+        else if (mode == "-c") out.match(entities.classes[score.index], score.score, echo_mode, echo_query);
+        else                   out.match(entities.functions[score.index], score.score, echo_mode, echo_query);
+    }
+}
+
+/** Whether cursors at location are ours: the main file, or a project header this unit claimed */
+bool ownsLocation(VisitContext& context, CXSourceLocation location) {
+    if (clang_Location_isFromMainFile(location) != 0) return true;
+    if (context.claims == NULL || clang_Location_isInSystemHeader(location) != 0) return false;
+
+    CXFile file = NULL;
+    clang_getExpansionLocation(location, &file, NULL, NULL, NULL);
+    if (file == NULL) return false;
+    auto it = context.owned.find(file);
+    if (it != context.owned.end()) return it->second;
+
+    std::string path = std::filesystem::absolute(ScopedCXString(clang_getFileName(file)).c_str())
+                           .lexically_normal().string();
+    std::string key = path + "#" + context.macro_key;
+    bool mine = context.claims->claim(key);
+    if (mine) {
+        context.claimed->push_back(std::move(key));
+    } else {
+        // claimed by an earlier attempt at this unit
+        mine = std::find(context.claimed->begin(), context.claimed->end(), key) != context.claimed->end();
+    }
+    context.owned.emplace(file, mine);
+    return mine;
+}
+
+CXChildVisitResult cursorVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
+    ++ThreadStats::local().cursors;
+    VisitContext* context = (VisitContext*)client_data;
+
+    // most cursors are statements and expressions inside declarations we already own, so
+    // only declarations pay for the location lookup that skips included headers
+    CXCursorKind cursor_kind = clang_getCursorKind(cursor);
+    bool collected = cursor_kind == CXCursor_FunctionDecl || cursor_kind == CXCursor_TypedefDecl ||
+                     cursor_kind == CXCursor_StructDecl || cursor_kind == CXCursor_ClassDecl;
+    if (!collected && !clang_isDeclaration(cursor_kind)) {
+        return CXChildVisit_Recurse;
+    }
+    CXSourceLocation location = clang_getCursorLocation(cursor);
+    if (!ownsLocation(*context, location)) {
+        return CXChildVisit_Continue;
+    }
+    if (!collected) {
+        return CXChildVisit_Recurse;
+    }
+
+    CXString presumed_filename;
+    unsigned int line, col;
+    clang_getPresumedLocation(location, &presumed_filename, &line, &col);
+    ScopedCXString filename(presumed_filename);
+    EntityAggregate* entities = context->entities;
+    ++ThreadStats::local().entities;
+
+    switch (cursor_kind) {
+    case CXCursor_FunctionDecl: {
+        ScopedCXString function_name(clang_getCursorSpelling(cursor));
+        ScopedCXString return_type(clang_getTypeSpelling(clang_getCursorResultType(cursor)));
+
+        Function& fn = entities->functions.emplace_back(
+            filename.c_str(), line, col, return_type.c_str(), function_name.c_str());
+        int arg_count = clang_Cursor_getNumArguments(cursor);
+        if (arg_count > 0) fn.args.reserve(arg_count);
+
+        clang_visitChildren(cursor, *functionDeclVisitor, &fn);
+        return CXChildVisit_Continue;
+    }
+    case CXCursor_TypedefDecl: {
+        ScopedCXString typedef_name(clang_getTypedefName(clang_getCursorType(cursor)));
+        ScopedCXString typedef_type(clang_getTypeSpelling(clang_getTypedefDeclUnderlyingType(cursor)));
+
+        entities->typedefs.emplace_back(
+            filename.c_str(), line, col, typedef_name.c_str(), typedef_type.c_str());
+        return CXChildVisit_Continue;
+    }
+    case CXCursor_StructDecl: {
+        ScopedCXString struct_name(clang_getCursorSpelling(cursor));
+
+        Struct& s = entities->structs.emplace_back(filename.c_str(), line, col, struct_name.c_str());
+        clang_visitChildren(cursor, *attributeDeclVisitor, &s);
+        break;
+    }
+    default: {
+        ScopedCXString class_name(clang_getCursorSpelling(cursor));
+
+        Class& c = entities->classes.emplace_back(filename.c_str(), line, col, class_name.c_str());
+        clang_visitChildren(cursor, *classDeclVisitor, &c);
+        break;
+    }
+    }
+
+    return CXChildVisit_Recurse;
+}
+
+/** Arguments of the Function in client_data */
+CXChildVisitResult functionDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
+    if (clang_getCursorKind(cursor) == CXCursor_ParmDecl) {
+        ScopedCXString param_name(clang_getCursorSpelling(cursor));
+        ScopedCXString param_type(clang_getTypeSpelling(clang_getCursorType(cursor)));
+
+        ((Function*)client_data)->add_arg(param_name.c_str(), param_type.c_str());
+    }
+
+    return CXChildVisit_Continue;
+}
+
+/** Fields of the Struct in client_data */
+CXChildVisitResult attributeDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
+    if (clang_getCursorKind(cursor) == CXCursor_FieldDecl) {
+        ScopedCXString attr_name(clang_getCursorSpelling(cursor));
+        ScopedCXString attr_type(clang_getTypeSpelling(clang_getCursorType(cursor)));
+
+        ((Struct*)client_data)->add_attr(attr_name.c_str(), attr_type.c_str());
+    }
+
+    return CXChildVisit_Continue;
+}
+
+/** Fields and methods of the Class in client_data */
+CXChildVisitResult classDeclVisitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
+    CXCursorKind kind = clang_getCursorKind(cursor);
+    Class* c = (Class*)client_data;
+
+    if (kind == CXCursor_FieldDecl) {
+        ScopedCXString attr_name(clang_getCursorSpelling(cursor));
+        ScopedCXString attr_type(clang_getTypeSpelling(clang_getCursorType(cursor)));
+
+        c->add_attr(attr_name.c_str(), attr_type.c_str());
+    }
+    else if (kind == CXCursor_CXXMethod) {
+        ScopedCXString method_name(clang_getCursorSpelling(cursor));
+        ScopedCXString return_type(clang_getTypeSpelling(clang_getCursorResultType(cursor)));
+        unsigned int line, col;
+        clang_getPresumedLocation(clang_getCursorLocation(cursor), NULL, &line, &col);
+
+        c->add_method(c->source.filename, line, col, return_type.c_str(), method_name.c_str());
+        clang_visitChildren(cursor, *functionDeclVisitor, &c->methods.back());
+    }
+
+    return CXChildVisit_Continue;
+}
+
+/**
+ * Query side of the bit-parallel Levenshtein kernel (Myers 1999, Hyyrö 2003).
+ * The pattern is split into 64-character blocks and peq holds, for every byte
+ * value, the positions where it occurs, so one machine word advances 64 cells
+ * of the DP column per candidate character. Build it once per query and reuse
+ * it for every candidate.
+ */
+class LevPattern {
+public:
+    explicit LevPattern(std::string_view pattern)
+    : length(pattern.size()), words((pattern.size() + 63) / 64), peq(256 * words, 0) {
+        for (size_t i = 0; i < length; ++i) {
+            peq[(unsigned char)pattern[i] * words + i / 64] |= uint64_t(1) << (i % 64);
+        }
+    }
+
+    size_t size() const { return length; }
+
+    /** Calculate the Levenshtein distance between the pattern and text */
+    int distance(std::string_view text) const {
+        ++ThreadStats::local().lev_calls;
+        if (length == 0) return text.size();
+        if (words == 1) return distance1<false>(text, INT_MAX);
+        return distanceN<false>(text, INT_MAX);
+    }
+
+    /**
+     * Same as distance(), but gives up as soon as the result is known to exceed
+     * max and returns max + 1. Distances never decrease along a DP diagonal
+     * (Ukkonen), so once the cell on the final cell's diagonal is above max,
+     * the remaining columns can be skipped.
+     */
+    int distance(std::string_view text, int max) const {
+        int n = text.size();
+        int m = length;
+        ++ThreadStats::local().lev_calls;
+        if (std::abs(n - m) > max) return max + 1;
+        if (length == 0) return n;
+        return words == 1 ? distance1<true>(text, max) : distanceN<true>(text, max);
+    }
+
+private:
+    static uint64_t lowBits(int count) {
+        return count >= 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+    }
+
+    /**
+     * The kernels, for one block or several. Bounded ones check the final
+     * cell's diagonal after every column and stop once it exceeds max; the
+     * others skip that check and just run to the end.
+     */
+    template<bool Bounded>
+    int distance1(std::string_view text, int max) const {
+        const uint64_t last = uint64_t(1) << (length - 1);
+        const int diagonal = (int)text.size() - (int)length;
+        uint64_t vp = ~uint64_t(0);
+        uint64_t vn = 0;
+        int dist = length;
+
+        for (int j = 0; j < (int)text.size(); ++j) {
+            uint64_t x = peq[(unsigned char)text[j]];
+            uint64_t d0 = (((x & vp) + vp) ^ vp) | x | vn;
+            uint64_t hp = vn | ~(d0 | vp);
+            uint64_t hn = d0 & vp;
+            dist += (hp & last) != 0;
+            dist -= (hn & last) != 0;
+            hp = (hp << 1) | 1;
+            hn = hn << 1;
+            vp = hn | ~(d0 | hp);
+            vn = hp & d0;
+
+            // D[i][j+1] on the final diagonal, from the column's vertical deltas
+            int i = j + 1 - diagonal;
+            if (Bounded && i >= 0) {
+                uint64_t mask = lowBits(i);
+                int cell = j + 1 + __builtin_popcountll(vp & mask) - __builtin_popcountll(vn & mask);
+                if (cell > max) {
+                    ThreadStats::local().dp_cells += (j + 1) * length;
+                    return max + 1;
+                }
+            }
+        }
+        ThreadStats::local().dp_cells += text.size() * length;
+        return dist <= max ? dist : max + 1;
+    }
+
+    /** Blocks pass their horizontal deltas upwards, one carry bit each */
+    template<bool Bounded>
+    int distanceN(std::string_view text, int max) const {
+        const uint64_t last = uint64_t(1) << ((length - 1) % 64);
+        const int diagonal = (int)text.size() - (int)length;
+        std::vector<uint64_t> vp(words, ~uint64_t(0));
+        std::vector<uint64_t> vn(words, 0);
+        int dist = length;
+
+        for (int j = 0; j < (int)text.size(); ++j) {
+            const uint64_t* eq = &peq[(unsigned char)text[j] * words];
+            uint64_t hp_carry = 1;
+            uint64_t hn_carry = 0;
+            for (size_t w = 0; w < words; ++w) {
+                uint64_t x = eq[w] | hn_carry;
+                uint64_t d0 = (((x & vp[w]) + vp[w]) ^ vp[w]) | x | vn[w];
+                uint64_t hp = vn[w] | ~(d0 | vp[w]);
+                uint64_t hn = d0 & vp[w];
+
+                uint64_t hp_in = hp_carry;
+                uint64_t hn_in = hn_carry;
+                if (w + 1 < words) {
+                    hp_carry = hp >> 63;
+                    hn_carry = hn >> 63;
+                } else {
+                    hp_carry = (hp & last) != 0;
+                    hn_carry = (hn & last) != 0;
+                }
+                hp = (hp << 1) | hp_in;
+                hn = (hn << 1) | hn_in;
+                vp[w] = hn | ~(d0 | hp);
+                vn[w] = hp & d0;
+            }
+            dist += hp_carry;
+            dist -= hn_carry;
+
+            int i = j + 1 - diagonal;
+            if (Bounded && i >= 0) {
+                int cell = j + 1;
+                for (size_t w = 0; w * 64 < (size_t)i; ++w) {
+                    uint64_t mask = lowBits(i - w * 64);
+                    cell += __builtin_popcountll(vp[w] & mask) - __builtin_popcountll(vn[w] & mask);
+                }
+                if (cell > max) {
+                    ThreadStats::local().dp_cells += (j + 1) * length;
+                    return max + 1;
+                }
+            }
+        }
+        ThreadStats::local().dp_cells += text.size() * length;
+        return dist <= max ? dist : max + 1;
+    }
+
+    size_t length;
+    size_t words;
+    std::vector<uint64_t> peq;  // [byte][block]
+};
+
+/**
+ * Inter-sequence Levenshtein kernel: one query against a batch of short
+ * candidates, one candidate per 8-bit SIMD lane, so a single pass over the
+ * DP column advances every candidate at once. Strings of at most 255
+ * characters keep every cell within a byte. AVX2 (32 lanes) or SSE4.1
+ * (16 lanes) is picked at runtime; lanes() is 0 on CPUs with neither, and
+ * callers fall back to LevPattern.
+ */
+class LevBatch {
+public:
+    /** Longer queries or candidates go to LevPattern */
+    static constexpr size_t kMaxLength = 255;
+    /** Batching pays off while the DP column is short; longer queries use LevPattern unless asked */
+    static constexpr size_t kAutoMaxLength = 64;
+    static constexpr size_t kMaxLanes = 32;
+
+    explicit LevBatch(std::string_view query_) : query(query_) {
+        // each query character broadcast to a full vector, loaded once per DP cell
+        pattern.resize(std::min(query.size(), kMaxLength));
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            memset(pattern[i].bytes, query[i], sizeof(pattern[i].bytes));
+        }
+    }
+
+    static size_t lanes() {
+        static const size_t lanes = __builtin_cpu_supports("avx2") ? 32
+                                  : __builtin_cpu_supports("sse4.1") ? 16 : 0;
+        return lanes;
+    }
+
+    /** Distances of the query to count <= lanes() texts of at most kMaxLength characters */
+    void distances(const std::string_view* texts, size_t count, int* out) const {
+        size_t longest = 0;
+        for (size_t lane = 0; lane < count; ++lane) longest = std::max(longest, texts[lane].size());
+        StatCounters& stats = ThreadStats::local();
+        stats.lev_calls += count;
+        stats.dp_cells += count * longest * pattern.size();
+        if (lanes() == 32) distancesAVX2(texts, count, out);
+        else distancesSSE41(texts, count, out);
+    }
+
+private:
+    /** Candidate characters transposed so column j of every lane is one load */
+    template<size_t Lanes>
+    static size_t transpose(const std::string_view* texts, size_t count,
+                            uint8_t (&chars)[kMaxLength][Lanes], uint8_t (&lengths)[Lanes]) {
+        size_t longest = 0;
+        for (size_t lane = 0; lane < count; ++lane) {
+            longest = std::max(longest, texts[lane].size());
+        }
+        memset(chars, 0, longest * Lanes);
+        memset(lengths, 0, Lanes);
+        for (size_t lane = 0; lane < count; ++lane) {
+            lengths[lane] = texts[lane].size();
+            for (size_t j = 0; j < texts[lane].size(); ++j) {
+                chars[j][lane] = texts[lane][j];
+            }
+        }
+        return longest;
+    }
+
+    __attribute__((target("avx2")))
+    void distancesAVX2(const std::string_view* texts, size_t count, int* out) const {
+        alignas(32) uint8_t chars[kMaxLength][32];
+        alignas(32) uint8_t lengths[32];
+        alignas(32) uint8_t result[32];
+        __m256i column[kMaxLength + 1];
+        const size_t m = query.size();
+        size_t longest = transpose(texts, count, chars, lengths);
+
+        const __m256i one = _mm256_set1_epi8(1);
+        for (size_t i = 0; i <= m; ++i) column[i] = _mm256_set1_epi8(i);
+        __m256i lens = _mm256_load_si256((const __m256i*)lengths);
+        __m256i best = column[m];
+
+        for (size_t j = 1; j <= longest; ++j) {
+            __m256i c = _mm256_load_si256((const __m256i*)chars[j - 1]);
+            __m256i diagonal = column[0];
+            column[0] = _mm256_set1_epi8(j);
+            for (size_t i = 1; i <= m; ++i) {
+                // equal lanes are 0xff and clear the substitution cost; adds saturate, so 255 stays 255
+                __m256i eq = _mm256_cmpeq_epi8(c, _mm256_load_si256((const __m256i*)pattern[i - 1].bytes));
+                __m256i substitute = _mm256_adds_epu8(diagonal, _mm256_andnot_si256(eq, one));
+                __m256i indel = _mm256_adds_epu8(_mm256_min_epu8(column[i], column[i - 1]), one);
+                diagonal = column[i];
+                column[i] = _mm256_min_epu8(substitute, indel);
+            }
+            __m256i done = _mm256_cmpeq_epi8(lens, _mm256_set1_epi8(j));
+            best = _mm256_blendv_epi8(best, column[m], done);
+        }
+
+        _mm256_store_si256((__m256i*)result, best);
+        for (size_t lane = 0; lane < count; ++lane) out[lane] = result[lane];
+    }
+
+    __attribute__((target("sse4.1")))
+    void distancesSSE41(const std::string_view* texts, size_t count, int* out) const {
+        alignas(16) uint8_t chars[kMaxLength][16];
+        alignas(16) uint8_t lengths[16];
+        alignas(16) uint8_t result[16];
+        __m128i column[kMaxLength + 1];
+        const size_t m = query.size();
+        size_t longest = transpose(texts, count, chars, lengths);
+
+        const __m128i one = _mm_set1_epi8(1);
+        for (size_t i = 0; i <= m; ++i) column[i] = _mm_set1_epi8(i);
+        __m128i lens = _mm_load_si128((const __m128i*)lengths);
+        __m128i best = column[m];
+
+        for (size_t j = 1; j <= longest; ++j) {
+            __m128i c = _mm_load_si128((const __m128i*)chars[j - 1]);
+            __m128i diagonal = column[0];
+            column[0] = _mm_set1_epi8(j);
+            for (size_t i = 1; i <= m; ++i) {
+                __m128i eq = _mm_cmpeq_epi8(c, _mm_load_si128((const __m128i*)pattern[i - 1].bytes));
+                __m128i substitute = _mm_adds_epu8(diagonal, _mm_andnot_si128(eq, one));
+                __m128i indel = _mm_adds_epu8(_mm_min_epu8(column[i], column[i - 1]), one);
+                diagonal = column[i];
+                column[i] = _mm_min_epu8(substitute, indel);
+            }
+            __m128i done = _mm_cmpeq_epi8(lens, _mm_set1_epi8(j));
+            best = _mm_blendv_epi8(best, column[m], done);
+        }
+
+        _mm_store_si128((__m128i*)result, best);
+        for (size_t lane = 0; lane < count; ++lane) out[lane] = result[lane];
+    }
+
+    struct alignas(32) Broadcast {
+        uint8_t bytes[32];
+    };
+
+    std::string query;
+    std::vector<Broadcast> pattern;
+};
+
+std::string scoreId(const Function& fn) { return fn.full_repr(); }
+std::string scoreId(const FunctionTable::Ref& fn) { return fn.full_repr(); }
+
+template<typename T>
+std::string scoreId(const T& t) { return t.repr(); }
+
+/** The representation of a match of a query in mode */
+std::string scoreId(const EntityStore& entities, std::string_view mode, const Score& score) {
+    if (mode == "-t") return scoreId(entities.typedefs[score.index]);
+    if (mode == "-s") return scoreId(entities.structs[score.index]);
+    if (mode == "-c") return scoreId(entities.classes[score.index]);
+    return scoreId(entities.functions[score.index]);
+}
+
+template<typename T>
+ScoreVec getScores(const T& ts, const std::string& query) {
+    LevPattern pattern(query);
+    ScoreVec scores;
+    scores.reserve(ts.size());
+    for (size_t i = 0; i < ts.size(); ++i) {
+        scores.push_back({ i, pattern.distance(ts[i].normal()) });
+    }
+    return scores;
+}
+
+/** Ranks entities with equal scores by source location, then by index */
+template<typename T>
+struct SourceOrder {
+    const T* ts;
+
+    bool operator()(size_t a, size_t b) const {
+        decltype(auto) ea = (*ts)[a];
+        decltype(auto) eb = (*ts)[b];
+        const auto& x = ea.source;
+        const auto& y = eb.source;
+        return std::tie(x.filename, x.line, x.col, a) < std::tie(y.filename, y.line, y.col, b);
+    }
+};
+
+/** Bounded max-heap of the k best (score, entity index) pairs; before(a, b) breaks ties */
+template<typename Before = std::less<size_t>>
+class TopK {
+public:
+    /** k comes from the user, so only a small heap is reserved up front and the rest grows on demand */
+    explicit TopK(size_t k_, Before before_ = Before())
+    : k(k_), ahead{before_} { heap.reserve(std::min<size_t>(k, 1024) + 1); }
+
+    /** Highest score that can still get in */
+    int cutoff() const {
+        if (k == 0) return -1;
+        return heap.size() < k ? INT_MAX - 1 : heap.front().first;
+    }
+
+    void push(int score, size_t index) {
+        if (score > cutoff()) return;
+        if (heap.size() == k && !ahead(std::make_pair(score, index), heap.front())) return;
+        heap.emplace_back(score, index);
+        std::push_heap(heap.begin(), heap.end(), ahead);
+        if (heap.size() > k) {
+            std::pop_heap(heap.begin(), heap.end(), ahead);
+            heap.pop_back();
+        }
+    }
+
+    /** Best first; empties the heap */
+    std::vector<std::pair<int, size_t>> take() {
+        std::sort_heap(heap.begin(), heap.end(), ahead);
+        return std::move(heap);
+    }
+
+private:
+    struct Ahead {
+        Before before;
+        bool operator()(const std::pair<int, size_t>& a, const std::pair<int, size_t>& b) const {
+            return a.first != b.first ? a.first < b.first : before(a.second, b.second);
+        }
+    };
+
+    size_t k;
+    Ahead ahead;
+    std::vector<std::pair<int, size_t>> heap;
+};
+
+/** Whether offsets[0..count] start at 0, never go down and end at total, i.e. split an array of total */
+bool validOffsets(const uint32_t* offsets, size_t count, uint32_t total) {
+    if (offsets[0] != 0 || offsets[count] != total) return false;
+    for (size_t i = 0; i < count; ++i) {
+        if (offsets[i] > offsets[i + 1]) return false;
+    }
+    return true;
+}
+
+/** Whether every one of count ids is below limit */
+bool validIds(const uint32_t* ids, size_t count, uint32_t limit) {
+    return std::all_of(ids, ids + count, [limit](uint32_t id) { return id < limit; });
+}
+
+/**
+ * Prefilter over the normal() strings of one entity kind: a length bucket
+ * table and an inverted list of q-grams. Edit distance d means at least
+ * |a| - |b| <= d and, by the q-gram lemma, max(|a|, |b|) - q + 1 - q*d
+ * shared q-grams, so search() only scores candidates that can still beat
+ * the current top-k cutoff, most promising first.
+ *
+ * Everything lives in one array of 32-bit words so it can be stored in and
+ * used straight out of a mapped index:
+ *
+ *   n, max_length, gram_count, posting_count,
+ *   lengths[n], length_offsets[max_length + 2], by_length[n],
+ *   gram_keys[gram_count], gram_offsets[gram_count + 1],
+ *   posting_ids[posting_count], posting_counts[posting_count]
+ */
+class QGramIndex {
+public:
+    static constexpr int q = 3;
+
+    QGramIndex() = default;
+    QGramIndex(const QGramIndex&) = delete;
+    QGramIndex& operator=(const QGramIndex&) = delete;
+
+    void build(const std::vector<std::string>& strings) {
+        uint32_t n = strings.size();
+        uint32_t max_length = 0;
+        for (auto& s : strings) max_length = std::max<uint32_t>(max_length, s.size());
+
+        // (gram, entity, count) triples sorted by gram then entity
+        std::vector<std::tuple<uint32_t, uint32_t, uint32_t>> postings;
+        for (uint32_t i = 0; i < n; ++i) {
+            for (auto& [key, count] : gramCounts(strings[i])) {
+                postings.emplace_back(key, i, count);
+            }
+        }
+        std::sort(postings.begin(), postings.end());
+
+        std::vector<uint32_t> keys;
+        std::vector<uint32_t> offsets;
+        for (uint32_t p = 0; p < postings.size(); ++p) {
+            if (keys.empty() || keys.back() != std::get<0>(postings[p])) {
+                keys.push_back(std::get<0>(postings[p]));
+                offsets.push_back(p);
+            }
+        }
+        offsets.push_back(postings.size());
+
+        storage.clear();
+        storage.push_back(n);
+        storage.push_back(max_length);
+        storage.push_back(keys.size());
+        storage.push_back(postings.size());
+        for (auto& s : strings) storage.push_back(s.size());
+
+        std::vector<uint32_t> bucket_sizes(max_length + 2, 0);
+        for (auto& s : strings) ++bucket_sizes[s.size() + 1];
+        for (uint32_t l = 1; l < bucket_sizes.size(); ++l) bucket_sizes[l] += bucket_sizes[l - 1];
+        storage.insert(storage.end(), bucket_sizes.begin(), bucket_sizes.end());
+        std::vector<uint32_t> by_length(n);
+        for (uint32_t i = 0; i < n; ++i) by_length[bucket_sizes[strings[i].size()]++] = i;
+        storage.insert(storage.end(), by_length.begin(), by_length.end());
+
+        storage.insert(storage.end(), keys.begin(), keys.end());
+        storage.insert(storage.end(), offsets.begin(), offsets.end());
+        for (auto& p : postings) storage.push_back(std::get<1>(p));
+        for (auto& p : postings) storage.push_back(std::get<2>(p));
+
+        load(storage.data(), storage.size());
+    }
+
+    /** Use words in place; they must outlive the index */
+    bool load(const uint32_t* words, size_t size) {
+        loaded = false;
+        if (words == NULL || size < 4) return false;
+        n = words[0];
+        max_length = words[1];
+        gram_count = words[2];
+        posting_count = words[3];
+        uint64_t expected = 4 + 2 * (uint64_t)n + ((uint64_t)max_length + 2) + (2 * (uint64_t)gram_count + 1)
+                          + 2 * (uint64_t)posting_count;
+        if (expected != size) return false;
+
+        lengths = words + 4;
+        length_offsets = lengths + n;
+        by_length = length_offsets + max_length + 2;
+        gram_keys = by_length + n;
+        gram_offsets = gram_keys + gram_count;
+        posting_ids = gram_offsets + gram_count + 1;
+        posting_counts = posting_ids + posting_count;
+        // search() indexes with all of these, so a damaged section is refused rather than trusted
+        if (!validOffsets(length_offsets, (size_t)max_length + 1, n) || !validIds(by_length, n, n)
+            || !validOffsets(gram_offsets, gram_count, posting_count) || !validIds(posting_ids, posting_count, n)) {
+            return false;
+        }
+        data = words;
+        data_size = size;
+        loaded = true;
+        return true;
+    }
+
+    bool valid() const { return loaded; }
+    size_t size() const { return n; }
+    std::vector<uint32_t> words() const { return std::vector<uint32_t>(data, data + data_size); }
+
+    /** Feed every entity that could still enter top to score(index, cutoff) */
+    template<typename Top, typename F>
+    void search(std::string_view query, Top& top, F&& score) const {
+        const int m = query.size();
+        // keeps the q-gram bound below from overflowing while the heap fills up
+        auto cutoff = [&]() { return std::min(top.cutoff(), 1 << 20); };
+        auto sharedNeeded = [&](int length, int max) {
+            return std::max(length, m) - q + 1 - q * max;
+        };
+
+        // q-grams that occur almost everywhere (" ( ", " , ") don't discriminate;
+        // instead of counting them assume every candidate shares them all
+        std::vector<uint32_t> shared(n, 0);
+        std::vector<uint32_t> hits;
+        int assumed = 0;
+        for (auto& [key, count] : gramCounts(query)) {
+            const uint32_t* it = std::lower_bound(gram_keys, gram_keys + gram_count, key);
+            if (it == gram_keys + gram_count || *it != key) continue;
+            size_t g = it - gram_keys;
+            if (gram_offsets[g + 1] - gram_offsets[g] > n / 8) {
+                assumed += count;
+                continue;
+            }
+            for (uint32_t p = gram_offsets[g]; p < gram_offsets[g + 1]; ++p) {
+                uint32_t id = posting_ids[p];
+                if (shared[id] == 0) hits.push_back(id);
+                shared[id] += std::min(count, posting_counts[p]);
+            }
+        }
+
+        // most shared q-grams first so the cutoff tightens quickly
+        std::sort(hits.begin(), hits.end(), [&](uint32_t a, uint32_t b) {
+            return shared[a] != shared[b] ? shared[a] > shared[b] : a < b;
+        });
+        for (uint32_t id : hits) {
+            int max = cutoff();
+            int length = lengths[id];
+            if (max < 0) return;
+            if (std::abs(length - m) > max || (int)shared[id] + assumed < sharedNeeded(length, max)) continue;
+            top.push(score(id, max), id);
+        }
+
+        // entities sharing no q-gram can only match while the cutoff is loose,
+        // walk their length buckets outwards from the query length
+        for (int delta = 0; m - delta >= 0 || m + delta <= (int)max_length; ++delta) {
+            int lengths_at[2] = { m - delta, m + delta };
+            for (int side = 0; side < (delta == 0 ? 1 : 2); ++side) {
+                int length = lengths_at[side];
+                if (length < 0 || length > (int)max_length) continue;
+                for (uint32_t b = length_offsets[length]; b < length_offsets[length + 1]; ++b) {
+                    int max = cutoff();
+                    if (delta > max) return;
+                    uint32_t id = by_length[b];
+                    if (shared[id] != 0 || assumed < sharedNeeded(length, max)) continue;
+                    top.push(score(id, max), id);
+                }
+            }
+        }
+    }
+
+private:
+    /** Distinct q-grams of s with their multiplicities */
+    static std::vector<std::pair<uint32_t, uint32_t>> gramCounts(std::string_view s) {
+        std::vector<uint32_t> keys;
+        for (size_t i = 0; i + q <= s.size(); ++i) {
+            keys.push_back((unsigned char)s[i] | (unsigned char)s[i + 1] << 8 | (unsigned char)s[i + 2] << 16);
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<std::pair<uint32_t, uint32_t>> counts;
+        for (uint32_t key : keys) {
+            if (!counts.empty() && counts.back().first == key) ++counts.back().second;
+            else counts.emplace_back(key, 1);
+        }
+        return counts;
+    }
+
+    std::vector<uint32_t> storage;
+    const uint32_t* data = NULL;
+    size_t data_size = 0;
+    bool loaded = false;
+
+    uint32_t n = 0;
+    uint32_t max_length = 0;
+    uint32_t gram_count = 0;
+    uint32_t posting_count = 0;
+    const uint32_t* lengths = NULL;
+    const uint32_t* length_offsets = NULL;
+    const uint32_t* by_length = NULL;
+    const uint32_t* gram_keys = NULL;
+    const uint32_t* gram_offsets = NULL;
+    const uint32_t* posting_ids = NULL;
+    const uint32_t* posting_counts = NULL;
+};
+
+/**
+ * BK-tree over the distinct normal() strings of one entity kind. Each node
+ * is one distinct string, its children are keyed by their distance to it,
+ * and by the triangle inequality a range query within r of the query only
+ * descends into children whose key lies in [d - r, d + r].
+ *
+ * Node strings are not stored, a node refers to the entities carrying its
+ * string and the first of them is used to compute distances. Layout, in
+ * 32-bit words, with node 0 as the root:
+ *
+ *   node_count, entity_count, child_count,
+ *   entity_offsets[node_count + 1], entity_ids[entity_count],
+ *   child_offsets[node_count + 1], child_distances[child_count], child_nodes[child_count]
+ */
+class BKTree {
+public:
+    BKTree() = default;
+    BKTree(const BKTree&) = delete;
+    BKTree& operator=(const BKTree&) = delete;
+
+    void build(const std::vector<std::string>& strings) {
+        struct Node {
+            std::vector<uint32_t> entities;
+            std::map<uint32_t, uint32_t> children;   // distance -> node
+        };
+        std::vector<Node> tree;
+        std::unordered_map<std::string_view, uint32_t> known;
+
+        for (uint32_t i = 0; i < strings.size(); ++i) {
+            auto it = known.find(strings[i]);
+            if (it != known.end()) {
+                tree[it->second].entities.push_back(i);
+                continue;
+            }
+
+            uint32_t node_id = tree.size();
+            if (!tree.empty()) {
+                LevPattern pattern(strings[i]);
+                uint32_t at = 0;
+                for (;;) {
+                    uint32_t d = pattern.distance(strings[tree[at].entities[0]]);
+                    auto child = tree[at].children.find(d);
+                    if (child == tree[at].children.end()) {
+                        tree[at].children.emplace(d, node_id);
+                        break;
+                    }
+                    at = child->second;
+                }
+            }
+            tree.emplace_back();
+            tree.back().entities.push_back(i);
+            known.emplace(strings[i], node_id);
+        }
+
+        uint32_t child_count = 0;
+        for (auto& node : tree) child_count += node.children.size();
+
+        storage.clear();
+        storage.push_back(tree.size());
+        storage.push_back(strings.size());
+        storage.push_back(child_count);
+        uint32_t offset = 0;
+        for (auto& node : tree) { storage.push_back(offset); offset += node.entities.size(); }
+        storage.push_back(offset);
+        for (auto& node : tree) storage.insert(storage.end(), node.entities.begin(), node.entities.end());
+        offset = 0;
+        for (auto& node : tree) { storage.push_back(offset); offset += node.children.size(); }
+        storage.push_back(offset);
+        for (auto& node : tree) for (auto& child : node.children) storage.push_back(child.first);
+        for (auto& node : tree) for (auto& child : node.children) storage.push_back(child.second);
+
+        load(storage.data(), storage.size());
+    }
+
+    /** Use words in place; they must outlive the tree */
+    bool load(const uint32_t* words, size_t size) {
+        loaded = false;
+        if (words == NULL || size < 3) return false;
+        node_count = words[0];
+        entity_count = words[1];
+        child_count = words[2];
+        uint64_t expected = 3 + 2 * ((uint64_t)node_count + 1) + entity_count + 2 * (uint64_t)child_count;
+        if (expected != size || (node_count == 0) != (entity_count == 0)) return false;
+
+        entity_offsets = words + 3;
+        entity_ids = entity_offsets + node_count + 1;
+        child_offsets = entity_ids + entity_count;
+        child_distances = child_offsets + node_count + 1;
+        child_nodes = child_distances + child_count;
+        // search() follows these unchecked: every node needs an entity, and children come after
+        // their parent, as build() numbers them, so a damaged tree can't send it out of bounds or in circles
+        if (!validOffsets(entity_offsets, node_count, entity_count) || !validIds(entity_ids, entity_count, entity_count)
+            || !validOffsets(child_offsets, node_count, child_count)) {
+            return false;
+        }
+        for (uint32_t node = 0; node < node_count; ++node) {
+            if (entity_offsets[node] == entity_offsets[node + 1]) return false;
+            for (uint32_t c = child_offsets[node]; c < child_offsets[node + 1]; ++c) {
+                if (child_nodes[c] <= node || child_nodes[c] >= node_count) return false;
+            }
+        }
+        data = words;
+        data_size = size;
+        loaded = true;
+        return true;
+    }
+
+    bool valid() const { return loaded; }
+    size_t size() const { return entity_count; }
+    std::vector<uint32_t> words() const { return std::vector<uint32_t>(data, data + data_size); }
+
+    /**
+     * Calls match(entity index, distance) for every entity within max_distance;
+     * distance(entity index) must return the exact distance to the query.
+     * Returns the number of distance evaluations.
+     */
+    template<typename D, typename F>
+    size_t search(int max_distance, D&& distance, F&& match) const {
+        size_t evaluations = 0;
+        if (node_count == 0) return evaluations;
+
+        std::vector<uint32_t> stack{ 0 };
+        while (!stack.empty()) {
+            uint32_t node = stack.back();
+            stack.pop_back();
+            int d = distance(entity_ids[entity_offsets[node]]);
+            ++evaluations;
+            if (d <= max_distance) {
+                for (uint32_t e = entity_offsets[node]; e < entity_offsets[node + 1]; ++e) {
+                    match(entity_ids[e], d);
+                }
+            }
+
+            const uint32_t* first = child_distances + child_offsets[node];
+            const uint32_t* last = child_distances + child_offsets[node + 1];
+            const uint32_t* lo = std::lower_bound(first, last, (uint32_t)std::max(0, d - max_distance));
+            const uint32_t* hi = std::upper_bound(lo, last, (uint32_t)(d + max_distance));
+            for (const uint32_t* c = lo; c < hi; ++c) {
+                stack.push_back(child_nodes[c - child_distances]);
+            }
+        }
+        return evaluations;
+    }
+
+private:
+    std::vector<uint32_t> storage;
+    const uint32_t* data = NULL;
+    size_t data_size = 0;
+    bool loaded = false;
+
+    uint32_t node_count = 0;
+    uint32_t entity_count = 0;
+    uint32_t child_count = 0;
+    const uint32_t* entity_offsets = NULL;
+    const uint32_t* entity_ids = NULL;
+    const uint32_t* child_offsets = NULL;
+    const uint32_t* child_distances = NULL;
+    const uint32_t* child_nodes = NULL;
+};
+
+enum class Scorer { Auto, BitParallel, Simd };
+
+struct SearchOptions {
+    size_t max_results = 10;
+    unsigned jobs = 1;
+    Scorer scorer = Scorer::Auto;
+};
+
+/**
+ * Full-scan half of getTopScores: scores ranges of entities against one
+ * query into a TopK, through LevBatch when the CPU and query length allow,
+ * batching candidates of similar length. Candidates already ruled out by
+ * their length are never batched.
+ */
+template<typename T>
+class LevScanner {
+public:
+    LevScanner(const T& ts_, const std::string& query_, Scorer scorer)
+    : ts(&ts_), query(query_), pattern(query_), batch(query_) {
+        const size_t batch_limit = scorer == Scorer::Simd ? LevBatch::kMaxLength
+                                 : scorer == Scorer::Auto ? LevBatch::kAutoMaxLength : 0;
+        batched = LevBatch::lanes() > 0 && query.size() <= batch_limit;
+    }
+
+    int distance(size_t i, int max) const { return pattern.distance((*ts)[i].normal(), max); }
+
+    void scan(TopK<SourceOrder<T>>& top, size_t begin, size_t end) const {
+        if (!batched) {
+            for (size_t i = begin; i < end; ++i) {
+                top.push(distance(i, top.cutoff()), i);
+            }
+            return;
+        }
+
+        // a std::string for entity structs, a view into the interner for an EntityStore
+        typedef decltype((*ts)[0].normal()) Text;
+        // a batch costs as much as its longest string, so batch similar lengths together
+        struct Pending {
+            Text texts[LevBatch::kMaxLanes];
+            std::string_view views[LevBatch::kMaxLanes];
+            size_t ids[LevBatch::kMaxLanes];
+            size_t count = 0;
+        };
+        Pending pending[LevBatch::kMaxLength / 16 + 1];
+        int distances[LevBatch::kMaxLanes];
+        auto flush = [&](Pending& batch_of) {
+            batch.distances(batch_of.views, batch_of.count, distances);
+            for (size_t lane = 0; lane < batch_of.count; ++lane) {
+                top.push(distances[lane], batch_of.ids[lane]);
+            }
+            batch_of.count = 0;
+        };
+
+        for (size_t i = begin; i < end; ++i) {
+            Text text = (*ts)[i].normal();
+            int max = top.cutoff();
+            if (std::abs((int)text.size() - (int)query.size()) > max) continue;
+            if (text.size() > LevBatch::kMaxLength) {
+                top.push(pattern.distance(text, max), i);
+                continue;
+            }
+            Pending& p = pending[text.size() / 16];
+            p.texts[p.count] = std::move(text);
+            p.views[p.count] = p.texts[p.count];
+            p.ids[p.count] = i;
+            if (++p.count == LevBatch::lanes()) flush(p);
+        }
+        for (auto& p : pending) {
+            if (p.count > 0) flush(p);
+        }
+    }
+
+private:
+    const T* ts;
+    std::string query;
+    LevPattern pattern;
+    LevBatch batch;
+    bool batched;
+};
+
+/**
+ * The k best matches, best first. A bounded max-heap holds the k best seen
+ * so far and its worst score is the cutoff handed to the distance kernel, so
+ * most candidates are rejected after a few columns. Only the survivors are
+ * rendered. With a prefilter only the candidates it lets through are scored,
+ * otherwise chunks of entities are scored on jobs threads, each keeping its
+ * own top k, and the partial results are merged. Ties are ranked by source
+ * location so the result doesn't depend on the thread count.
+ */
+template<typename T>
+ScoreVec getTopScores(const T& ts, const std::string& query, const SearchOptions& opts,
+                      const QGramIndex* prefilter = NULL) {
+    constexpr size_t chunk_size = 4096;
+    LevScanner<T> scanner(ts, query, opts.scorer);
+    SourceOrder<T> order{&ts};
+    TopK top(opts.max_results, order);
+    auto score = [&](size_t i, int max) { return scanner.distance(i, max); };
+
+    size_t chunks = (ts.size() + chunk_size - 1) / chunk_size;
+    unsigned jobs = std::max(1u, std::min<unsigned>(opts.jobs, chunks));
+
+    if (prefilter != NULL && prefilter->valid() && prefilter->size() == ts.size()) {
+        prefilter->search(query, top, score);
+    }
+    else if (jobs == 1) {
+        scanner.scan(top, 0, ts.size());
+    }
+    else {
+        std::vector<TopK<SourceOrder<T>>> partial(jobs, TopK(opts.max_results, order));
+        std::atomic<size_t> next_chunk{0};
+        auto worker = [&](TopK<SourceOrder<T>>& local) {
+            for (size_t c = next_chunk++; c < chunks; c = next_chunk++) {
+                scanner.scan(local, c * chunk_size, std::min(ts.size(), (c + 1) * chunk_size));
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned w = 1; w < jobs; ++w) {
+            workers.emplace_back(worker, std::ref(partial[w]));
+        }
+        worker(partial[0]);
+        for (auto& w : workers) {
+            w.join();
+        }
+
+        for (auto& local : partial) {
+            for (auto& [score, i] : local.take()) {
+                top.push(score, i);
+            }
+        }
+    }
+
+    ScoreVec scores;
+    for (auto& [score, i] : top.take()) {
+        scores.push_back({ i, score });
+    }
+    return scores;
+}
+
+/**
+ * getTopScores of many queries in one pass over the entities: every chunk
+ * is scored against all the queries while it's still in cache, instead of
+ * streaming through all entities once per query.
+ */
+template<typename T>
+std::vector<ScoreVec> getBatchTopScores(const T& ts, const std::vector<std::string>& queries,
+                                        const SearchOptions& opts) {
+    constexpr size_t chunk_size = 4096;
+    std::vector<LevScanner<T>> scanners;
+    scanners.reserve(queries.size());
+    for (auto& query : queries) {
+        scanners.emplace_back(ts, query, opts.scorer);
+    }
+    SourceOrder<T> order{&ts};
+    typedef std::vector<TopK<SourceOrder<T>>> Tops;
+
+    size_t chunks = (ts.size() + chunk_size - 1) / chunk_size;
+    unsigned jobs = std::max(1u, std::min<unsigned>(opts.jobs, chunks));
+    std::vector<Tops> partial(jobs, Tops(queries.size(), TopK(opts.max_results, order)));
+    std::atomic<size_t> next_chunk{0};
+    auto worker = [&](Tops& local) {
+        for (size_t c = next_chunk++; c < chunks; c = next_chunk++) {
+            size_t begin = c * chunk_size, end = std::min(ts.size(), (c + 1) * chunk_size);
+            for (size_t q = 0; q < scanners.size(); ++q) {
+                scanners[q].scan(local[q], begin, end);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned w = 1; w < jobs; ++w) {
+        workers.emplace_back(worker, std::ref(partial[w]));
+    }
+    worker(partial[0]);
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    std::vector<ScoreVec> results(queries.size());
+    for (size_t q = 0; q < queries.size(); ++q) {
+        TopK top(opts.max_results, order);
+        for (auto& local : partial) {
+            for (auto& [score, i] : local[q].take()) {
+                top.push(score, i);
+            }
+        }
+        for (auto& [score, i] : top.take()) {
+            results[q].push_back({ i, score });
+        }
+    }
+    return results;
+}
+
+/**
+ * Every match within max_distance, best first. With a BK-tree only the
+ * subtrees that can hold such matches are visited; --stats reports how many
+ * distance evaluations that left out of the candidates.
+ */
+template<typename T>
+ScoreVec getRangeScores(const T& ts, const std::string& query, int max_distance,
+                        const BKTree* tree = NULL) {
+    LevPattern pattern(query);
+    std::vector<std::pair<int, size_t>> matches;
+    size_t evaluations = 0;
+
+    if (tree != NULL && tree->valid() && tree->size() == ts.size()) {
+        evaluations = tree->search(max_distance,
+            [&](size_t i) { return pattern.distance(ts[i].normal()); },
+            [&](size_t i, int d) { matches.emplace_back(d, i); });
+    } else {
+        for (size_t i = 0; i < ts.size(); ++i) {
+            int d = pattern.distance(ts[i].normal(), max_distance);
+            if (d <= max_distance) matches.emplace_back(d, i);
+        }
+        evaluations = ts.size();
+    }
+    StatCounters& stats = ThreadStats::local();
+    stats.range_candidates += ts.size();
+    stats.range_evaluations += evaluations;
+
+    SourceOrder<T> order{&ts};
+    std::sort(matches.begin(), matches.end(), [&](auto& a, auto& b) {
+        return a.first != b.first ? a.first < b.first : order(a.second, b.second);
+    });
+    ScoreVec scores;
+    for (auto& [score, i] : matches) {
+        scores.push_back({ i, score });
+    }
+    return scores;
+}
+
+const Score& bestMatch(const ScoreVec& scores) {
+    return *std::min_element(scores.begin(), scores.end(),
+                [](auto& a, auto& b){ return a.score < b.score; });
+}
+
+void sortScores(ScoreVec& scores) {
+    std::sort(scores.begin(), scores.end(),
+        [](auto& a, auto& b){ return a.score < b.score; });
+}
+
+TokenVec tokenizeQuery(const std::string& query) {
+    TokenVec tokens;
+
+    stb_lexer lexer;
+    char string_storage[1024];
+    // void stb_c_lexer_init(stb_lexer *lexer,
+    //                       const char *input_stream,
+    //                       const char *input_stream_end,
+    //                       char *string_store,
+    //                       int store_length);
+    stb_c_lexer_init(&lexer, query.c_str(), query.c_str() + query.size(), string_storage, 1024);
+
+    while (stb_c_lexer_get_token(&lexer)) {
+        if (lexer.token < CLEX_eof) {
+            tokens.push_back(std::string(1, (char)lexer.token));
+        }
+        else if (lexer.token == CLEX_id) {
+            tokens.push_back(std::string(lexer.string));
+        }
+    }
+
+    return tokens;
+}
+
+std::string normalizeQuery(TokenVec&& tokens) {
+    std::string normalized_query;
+    for (auto& tok : tokens) {
+        normalized_query += tok + " ";
+    }
+    return normalized_query;
+}
+
+/**
+ * Sorted, de-duplicated token strings; a token's id is its position. Stored
+ * as one array of 32-bit words so it can be used straight out of a mapped
+ * index:
+ *
+ *   count, byte_offsets[count + 1], bytes (padded to a whole word)
+ */
+class TokenVocabulary {
+public:
+    static constexpr uint32_t kUnknown = UINT32_MAX;
+
+    TokenVocabulary() = default;
+    TokenVocabulary(const TokenVocabulary&) = delete;
+    TokenVocabulary& operator=(const TokenVocabulary&) = delete;
+
+    void build(std::vector<std::string> tokens) {
+        std::sort(tokens.begin(), tokens.end());
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+        std::string bytes;
+        storage.clear();
+        storage.push_back(tokens.size());
+        for (auto& token : tokens) {
+            storage.push_back(bytes.size());
+            bytes += token;
+        }
+        storage.push_back(bytes.size());
+        size_t first = storage.size();
+        storage.resize(first + (bytes.size() + 3) / 4, 0);
+        memcpy(&storage[first], bytes.data(), bytes.size());
+
+        load(storage.data(), storage.size());
+    }
+
+    /** Use words in place; they must outlive the vocabulary */
+    bool load(const uint32_t* words, size_t size) {
+        loaded = false;
+        if (words == NULL || size < 2) return false;
+        count = words[0];
+        if (size < 2 + (uint64_t)count) return false;
+        offsets = words + 1;
+        bytes = (const char*)(offsets + count + 1);
+        uint64_t byte_capacity = (size - 2 - (uint64_t)count) * 4;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (offsets[i] > offsets[i + 1]) return false;
+        }
+        if (offsets[count] > byte_capacity) return false;
+        data = words;
+        data_size = size;
+        loaded = true;
+        return true;
+    }
+
+    bool valid() const { return loaded; }
+    size_t size() const { return count; }
+    std::vector<uint32_t> words() const { return std::vector<uint32_t>(data, data + data_size); }
+
+    std::string_view token(uint32_t id) const {
+        return std::string_view(bytes + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    /** Id of token, or kUnknown if no entity uses it */
+    uint32_t find(std::string_view text) const {
+        uint32_t lo = 0, hi = count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (token(mid) < text) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo < count && token(lo) == text ? lo : kUnknown;
+    }
+
+    std::vector<uint32_t> ids(const TokenVec& tokens) const {
+        std::vector<uint32_t> result;
+        result.reserve(tokens.size());
+        for (auto& tok : tokens) result.push_back(find(tok));
+        return result;
+    }
+
+private:
+    std::vector<uint32_t> storage;
+    const uint32_t* data = NULL;
+    size_t data_size = 0;
+    bool loaded = false;
+
+    uint32_t count = 0;
+    const uint32_t* offsets = NULL;
+    const char* bytes = NULL;
+};
+
+/**
+ * The token ids of every entity of one kind, in unit order:
+ *
+ *   count, id_count, offsets[count + 1], ids[id_count]
+ */
+class TokenSequences {
+public:
+    TokenSequences() = default;
+    TokenSequences(const TokenSequences&) = delete;
+    TokenSequences& operator=(const TokenSequences&) = delete;
+
+    void build(const std::vector<TokenVec>& sequences, const TokenVocabulary& vocabulary) {
+        storage.clear();
+        storage.push_back(sequences.size());
+        storage.push_back(0);
+        uint32_t offset = 0;
+        for (auto& tokens : sequences) { storage.push_back(offset); offset += tokens.size(); }
+        storage.push_back(offset);
+        storage[1] = offset;
+        for (auto& tokens : sequences) {
+            for (auto& tok : tokens) storage.push_back(vocabulary.find(tok));
+        }
+
+        load(storage.data(), storage.size());
+    }
+
+    /** Use words in place; they must outlive the sequences */
+    bool load(const uint32_t* words, size_t size) {
+        loaded = false;
+        if (words == NULL || size < 2) return false;
+        count = words[0];
+        uint32_t id_count = words[1];
+        if (size != 3 + (uint64_t)count + id_count) return false;
+        offsets = words + 2;
+        ids = offsets + count + 1;
+        if (offsets[0] != 0 || offsets[count] != id_count) return false;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (offsets[i] > offsets[i + 1]) return false;
+        }
+        data = words;
+        data_size = size;
+        loaded = true;
+        return true;
+    }
+
+    bool valid() const { return loaded; }
+    size_t size() const { return count; }
+    std::vector<uint32_t> words() const { return std::vector<uint32_t>(data, data + data_size); }
+
+    const uint32_t* begin(size_t i) const { return ids + offsets[i]; }
+    size_t length(size_t i) const { return offsets[i + 1] - offsets[i]; }
+
+private:
+    std::vector<uint32_t> storage;
+    const uint32_t* data = NULL;
+    size_t data_size = 0;
+    bool loaded = false;
+
+    uint32_t count = 0;
+    const uint32_t* offsets = NULL;
+    const uint32_t* ids = NULL;
+};
+
+/**
+ * Levenshtein distance over token ids, so "unsigned int" vs "size_t" is two
+ * edits rather than eleven. Signatures are a handful of tokens, so a query
+ * of up to 64 tokens runs Myers' algorithm in one word; the match mask of a
+ * text token is found by a linear scan over the query's few distinct ids.
+ */
+class TokenPattern {
+public:
+    explicit TokenPattern(std::vector<uint32_t> pattern_)
+    : pattern(std::move(pattern_)) {
+        if (pattern.size() > 64) return;
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            auto it = std::find_if(peq.begin(), peq.end(), [&](auto& e) { return e.first == pattern[i]; });
+            if (it == peq.end()) it = peq.insert(peq.end(), { pattern[i], 0 });
+            it->second |= uint64_t(1) << i;
+        }
+    }
+
+    size_t size() const { return pattern.size(); }
+
+    /** Distance to text, or max + 1 once it is known to exceed max */
+    int distance(const uint32_t* text, size_t n, int max) const {
+        int m = pattern.size();
+        ++ThreadStats::local().lev_calls;
+        if (std::abs((int)n - m) > max) return max + 1;
+        ThreadStats::local().dp_cells += n * m;
+        if (m == 0) return n;
+        int dist = m <= 64 ? distance1(text, n) : distanceN(text, n);
+        return dist <= max ? dist : max + 1;
+    }
+
+private:
+    uint64_t mask(uint32_t id) const {
+        for (auto& [token, bits] : peq) {
+            if (token == id) return bits;
+        }
+        return 0;
+    }
+
+    int distance1(const uint32_t* text, size_t n) const {
+        const uint64_t last = uint64_t(1) << (pattern.size() - 1);
+        uint64_t vp = ~uint64_t(0);
+        uint64_t vn = 0;
+        int dist = pattern.size();
+        for (size_t j = 0; j < n; ++j) {
+            uint64_t x = mask(text[j]);
+            uint64_t d0 = (((x & vp) + vp) ^ vp) | x | vn;
+            uint64_t hp = vn | ~(d0 | vp);
+            uint64_t hn = d0 & vp;
+            dist += (hp & last) != 0;
+            dist -= (hn & last) != 0;
+            hp = (hp << 1) | 1;
+            hn = hn << 1;
+            vp = hn | ~(d0 | hp);
+            vn = hp & d0;
+        }
+        return dist;
+    }
+
+    int distanceN(const uint32_t* text, size_t n) const {
+        std::vector<int> row(pattern.size() + 1);
+        for (size_t i = 0; i < row.size(); ++i) row[i] = i;
+        for (size_t j = 0; j < n; ++j) {
+            int diag = row[0];
+            row[0] = j + 1;
+            for (size_t i = 1; i < row.size(); ++i) {
+                int up = row[i];
+                row[i] = std::min({ up + 1, row[i - 1] + 1, diag + (pattern[i - 1] != text[j]) });
+                diag = up;
+            }
+        }
+        return row.back();
+    }
+
+    std::vector<uint32_t> pattern;
+    std::vector<std::pair<uint32_t, uint64_t>> peq;
+};
+
+/**
+ * Same as getTopScores()/getRangeScores(), but compares token ids rather than
+ * characters: the max_results best matches, or with max_distance >= 0 every
+ * match within that many token edits.
+ */
+template<typename T>
+ScoreVec getTokenScores(const T& ts, const TokenSequences& sequences, const TokenPattern& pattern,
+                        const SearchOptions& opts, int max_distance = -1) {
+    SourceOrder<T> order{&ts};
+    std::vector<std::pair<int, size_t>> matches;
+    if (max_distance >= 0) {
+        for (size_t i = 0; i < ts.size(); ++i) {
+            int d = pattern.distance(sequences.begin(i), sequences.length(i), max_distance);
+            if (d <= max_distance) matches.emplace_back(d, i);
+        }
+        std::sort(matches.begin(), matches.end(), [&](auto& a, auto& b) {
+            return a.first != b.first ? a.first < b.first : order(a.second, b.second);
+        });
+    } else {
+        TopK top(opts.max_results, order);
+        for (size_t i = 0; i < ts.size(); ++i) {
+            top.push(pattern.distance(sequences.begin(i), sequences.length(i), top.cutoff()), i);
+        }
+        matches = top.take();
+    }
+
+    ScoreVec scores;
+    for (auto& [score, i] : matches) {
+        scores.push_back({ i, score });
+    }
+    return scores;
+}
+
+/** A type reduced to what unification compares: base name, indirections and constness */
+struct CanonicalType {
+    std::string base;
+    int pointers = 0;
+    bool is_const = false;
+};
+
+/**
+ * Turns type spellings into canonical types: qualifiers and tag keywords
+ * are dropped, `*`, `&` and `[]` count as indirections, integer spellings
+ * are normalized ("unsigned long int" is "unsigned long") and typedefs
+ * collected from the project are expanded.
+ */
+class TypeResolver {
+public:
+    template<typename T>
+    void add(const T& typedefs) {
+        for (size_t i = 0; i < typedefs.size(); ++i) {
+            auto&& t = typedefs[i];
+            aliases.emplace(t.alias, t.aliased);
+        }
+    }
+
+    CanonicalType resolve(std::string_view spelling) const {
+        TokenVec tokens = tokenizeQuery(std::string(spelling));
+        return resolve(tokens.begin(), tokens.end());
+    }
+
+    CanonicalType resolve(TokenVec::const_iterator first, TokenVec::const_iterator last) const {
+        CanonicalType type = parse(first, last);
+        for (int depth = 0; depth < 8; ++depth) {
+            auto it = aliases.find(type.base);
+            if (it == aliases.end()) break;
+            TokenVec tokens = tokenizeQuery(it->second);
+            CanonicalType expanded = parse(tokens.begin(), tokens.end());
+            if (expanded.base == type.base || expanded.base.empty()) break;
+            type.base = expanded.base;
+            type.pointers += expanded.pointers;
+            type.is_const = type.is_const || expanded.is_const;
+        }
+        return type;
+    }
+
+private:
+    static bool isIdentifier(const std::string& tok) {
+        return !tok.empty() && (isalpha((unsigned char)tok[0]) || tok[0] == '_');
+    }
+
+    static CanonicalType parse(TokenVec::const_iterator first, TokenVec::const_iterator last) {
+        static const std::set<std::string> ignored = {
+            "volatile", "restrict", "struct", "union", "enum", "class", "typename"
+        };
+        static const std::set<std::string> integers = {
+            "signed", "unsigned", "short", "long", "int", "char"
+        };
+
+        CanonicalType type;
+        std::vector<std::string> pieces;
+        bool opaque = false;
+        for (auto tok = first; tok != last; ++tok) {
+            if (*tok == "const") type.is_const = true;
+            else if (ignored.count(*tok)) continue;
+            else if (*tok == "*" || *tok == "&" || *tok == "[") ++type.pointers;
+            else if (*tok == "]") continue;
+            else {
+                if (*tok == "(") opaque = true;
+                pieces.push_back(*tok);
+            }
+        }
+
+        // function pointers and the like are only compared by spelling
+        if (opaque) {
+            type.pointers = 0;
+            for (auto tok = first; tok != last; ++tok) {
+                if (!type.base.empty() && isIdentifier(*tok) && isIdentifier(type.base.substr(type.base.size() - 1))) type.base += " ";
+                type.base += *tok;
+            }
+            return type;
+        }
+
+        bool integer = !pieces.empty() && std::all_of(pieces.begin(), pieces.end(),
+                                                      [](auto& p) { return integers.count(p) > 0; });
+        if (integer) {
+            bool is_char = std::find(pieces.begin(), pieces.end(), "char") != pieces.end();
+            if (pieces.size() > 1) pieces.erase(std::remove(pieces.begin(), pieces.end(), "int"), pieces.end());
+            if (!is_char && pieces.size() > 1) pieces.erase(std::remove(pieces.begin(), pieces.end(), "signed"), pieces.end());
+            if (pieces.size() == 1 && pieces[0] == "signed") pieces[0] = "int";
+        }
+
+        for (auto& piece : pieces) {
+            if (!type.base.empty() && isIdentifier(piece) && isIdentifier(type.base.substr(type.base.size() - 1))) type.base += " ";
+            type.base += piece;
+        }
+        return type;
+    }
+
+    std::unordered_map<std::string, std::string> aliases;
+};
+
+/**
+ * Function signatures as canonical type codes, bucketed by arity and return
+ * base type so a structured query only looks at functions it could unify
+ * with. A code packs base id << 8 | indirections << 1 | const, base ids
+ * being positions in a separate TokenVocabulary of base names.
+ *
+ *   n, bucket_count, code_count,
+ *   bucket_arity[bucket_count], bucket_return[bucket_count],
+ *   bucket_offsets[bucket_count + 1], bucket_ids[n],
+ *   signature_offsets[n + 1], codes[code_count]   -- return type first
+ */
+class SignatureIndex {
+public:
+    static constexpr uint32_t kUnknownBase = 0xffffff;
+    static constexpr uint32_t kWildcard = UINT32_MAX;
+    /** Arguments are only permuted up to this arity; beyond it they must line up */
+    static constexpr size_t kMaxPermuted = 8;
+
+    SignatureIndex() = default;
+    SignatureIndex(const SignatureIndex&) = delete;
+    SignatureIndex& operator=(const SignatureIndex&) = delete;
+
+    static uint32_t code(uint32_t base, const CanonicalType& type) {
+        if (base > kUnknownBase) base = kUnknownBase;
+        return base << 8 | (uint32_t)std::min(type.pointers, 127) << 1 | (type.is_const ? 1 : 0);
+    }
+
+    /** Query codes; "_" matches any type */
+    static std::vector<uint32_t> codes(const std::vector<CanonicalType>& types, const TokenVocabulary& bases) {
+        std::vector<uint32_t> result;
+        for (auto& type : types) {
+            result.push_back(type.base == "_" ? kWildcard : code(bases.find(type.base), type));
+        }
+        return result;
+    }
+
+    /** signatures[i] holds the codes of function i, return type first */
+    void build(const std::vector<std::vector<uint32_t>>& signatures) {
+        std::vector<uint32_t> order(signatures.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        auto key = [&](uint32_t i) {
+            return std::make_pair((uint32_t)signatures[i].size() - 1, signatures[i][0] >> 8);
+        };
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return key(a) < key(b); });
+
+        std::vector<std::pair<uint32_t, uint32_t>> buckets;
+        std::vector<uint32_t> bucket_offsets;
+        for (uint32_t at = 0; at < order.size(); ++at) {
+            if (at == 0 || key(order[at]) != key(order[at - 1])) {
+                buckets.push_back(key(order[at]));
+                bucket_offsets.push_back(at);
+            }
+        }
+        bucket_offsets.push_back(order.size());
+
+        storage.clear();
+        storage.push_back(signatures.size());
+        storage.push_back(buckets.size());
+        storage.push_back(0);
+        for (auto& b : buckets) storage.push_back(b.first);
+        for (auto& b : buckets) storage.push_back(b.second);
+        storage.insert(storage.end(), bucket_offsets.begin(), bucket_offsets.end());
+        storage.insert(storage.end(), order.begin(), order.end());
+        uint32_t offset = 0;
+        for (auto& s : signatures) { storage.push_back(offset); offset += s.size(); }
+        storage.push_back(offset);
+        storage[2] = offset;
+        for (auto& s : signatures) storage.insert(storage.end(), s.begin(), s.end());
+
+        load(storage.data(), storage.size());
+    }
+
+    /** Use words in place; they must outlive the index */
+    bool load(const uint32_t* words, size_t size) {
+        loaded = false;
+        if (words == NULL || size < 3) return false;
+        n = words[0];
+        bucket_count = words[1];
+        uint32_t code_count = words[2];
+        uint64_t expected = 3 + 3 * (uint64_t)bucket_count + 1 + 2 * (uint64_t)n + 1 + code_count;
+        if (expected != size) return false;
+
+        bucket_arity = words + 3;
+        bucket_return = bucket_arity + bucket_count;
+        bucket_offsets = bucket_return + bucket_count;
+        bucket_ids = bucket_offsets + bucket_count + 1;
+        signature_offsets = bucket_ids + n;
+        signature_codes = signature_offsets + n + 1;
+        if (bucket_offsets[bucket_count] != n || signature_offsets[n] != code_count) return false;
+        for (uint32_t i = 0; i < n; ++i) {
+            if (bucket_ids[i] >= n || signature_offsets[i] >= signature_offsets[i + 1]) return false;
+        }
+        for (uint32_t b = 0; b < bucket_count; ++b) {
+            if (bucket_offsets[b] > bucket_offsets[b + 1]) return false;
+        }
+        data = words;
+        data_size = size;
+        loaded = true;
+        return true;
+    }
+
+    bool valid() const { return loaded; }
+    size_t size() const { return n; }
+    std::vector<uint32_t> words() const { return std::vector<uint32_t>(data, data + data_size); }
+
+    /**
+     * Pushes (cost, function index) into top for every function with the
+     * query's arity whose return type unifies with the query's. The cost
+     * adds 2 per indirection and 1 per const that had to be relaxed, and 1
+     * per argument that had to move to line up with the query.
+     */
+    template<typename Top>
+    void search(const std::vector<uint32_t>& query, Top& top) const {
+        if (query.empty()) return;
+        uint32_t arity = query.size() - 1;
+        auto first = std::make_pair(arity, query[0] == kWildcard ? 0 : query[0] >> 8);
+        auto last = std::make_pair(arity, query[0] == kWildcard ? kUnknownBase : query[0] >> 8);
+
+        uint32_t lo = 0, hi = bucket_count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (std::make_pair(bucket_arity[mid], bucket_return[mid]) < first) lo = mid + 1;
+            else hi = mid;
+        }
+        for (uint32_t b = lo; b < bucket_count && std::make_pair(bucket_arity[b], bucket_return[b]) <= last; ++b) {
+            for (uint32_t e = bucket_offsets[b]; e < bucket_offsets[b + 1]; ++e) {
+                uint32_t id = bucket_ids[e];
+                const uint32_t* sig = signature_codes + signature_offsets[id];
+                int max = top.cutoff();
+                int cost = unify(query[0], sig[0]);
+                if (cost > max || cost >= kMismatch) continue;
+                cost += unifyArgs(query.data() + 1, sig + 1, arity, max - cost);
+                if (cost <= max && cost < kMismatch) top.push(cost, id);
+            }
+        }
+    }
+
+private:
+    static constexpr int kMismatch = 1 << 20;
+
+    static int unify(uint32_t query, uint32_t candidate) {
+        if (query == kWildcard) return 0;
+        if ((query >> 8) != (candidate >> 8) || (query >> 8) == kUnknownBase) return kMismatch;
+        int pointers = std::abs((int)((query >> 1) & 127) - (int)((candidate >> 1) & 127));
+        return 2 * pointers + (int)((query ^ candidate) & 1);
+    }
+
+    /** Cheapest assignment of query arguments to candidate arguments, or more than max */
+    static int unifyArgs(const uint32_t* query, const uint32_t* candidate, uint32_t arity, int max) {
+        if (arity > kMaxPermuted) {
+            int cost = 0;
+            for (uint32_t i = 0; i < arity && cost <= max; ++i) cost += unify(query[i], candidate[i]);
+            return cost;
+        }
+
+        // best[mask]: cheapest way to place the first popcount(mask) query args on the args in mask
+        int best[1 << kMaxPermuted];
+        best[0] = 0;
+        for (uint32_t mask = 1; mask < (1u << arity); ++mask) best[mask] = kMismatch;
+        for (uint32_t mask = 0; mask + 1 < (1u << arity); ++mask) {
+            if (best[mask] > max) continue;
+            uint32_t i = __builtin_popcount(mask);
+            for (uint32_t j = 0; j < arity; ++j) {
+                if (mask & (1u << j)) continue;
+                int cost = best[mask] + unify(query[i], candidate[j]) + (i != j);
+                best[mask | 1u << j] = std::min(best[mask | 1u << j], cost);
+            }
+        }
+        return best[(1u << arity) - 1];
+    }
+
+    std::vector<uint32_t> storage;
+    const uint32_t* data = NULL;
+    size_t data_size = 0;
+    bool loaded = false;
+
+    uint32_t n = 0;
+    uint32_t bucket_count = 0;
+    const uint32_t* bucket_arity = NULL;
+    const uint32_t* bucket_return = NULL;
+    const uint32_t* bucket_offsets = NULL;
+    const uint32_t* bucket_ids = NULL;
+    const uint32_t* signature_offsets = NULL;
+    const uint32_t* signature_codes = NULL;
+};
+
+/** Splits "ret (a, b)" into canonical types, return type first; false if it isn't a signature */
+bool parseSignature(const std::string& query, const TypeResolver& resolver, std::vector<CanonicalType>& types) {
+    TokenVec tokens = tokenizeQuery(query);
+    auto open = std::find(tokens.begin(), tokens.end(), "(");
+    if (open == tokens.end() || open == tokens.begin()) return false;
+    types.clear();
+    types.push_back(resolver.resolve(tokens.begin(), open));
+
+    int depth = 0;
+    auto arg = open + 1;
+    for (auto tok = open + 1; tok != tokens.end(); ++tok) {
+        if (*tok == "(" || *tok == "<") ++depth;
+        else if ((*tok == ")" || *tok == ">") && depth > 0) --depth;
+        else if (depth == 0 && (*tok == "," || *tok == ")")) {
+            if (tok == arg && *tok == ")" && types.size() == 1) return true;
+            if (tok == arg) return false;
+            types.push_back(resolver.resolve(arg, tok));
+            arg = tok + 1;
+            if (*tok == ")") {
+                // "int (void)" takes no arguments
+                if (types.size() == 2 && types[1].base == "void" && types[1].pointers == 0) types.pop_back();
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/** Canonical signatures of every function in unit order, with their base names */
+void buildSignatureIndex(const std::vector<IndexUnit>& units, TokenVocabulary& bases, SignatureIndex& index) {
+    TypeResolver resolver;
+    for (auto& unit : units) resolver.add(unit.entities.typedefs);
+
+    // intern base names in arrival order first, then renumber them in vocabulary order
+    std::unordered_map<std::string, uint32_t> provisional;
+    std::vector<std::string> names;
+    std::vector<std::vector<uint32_t>> signatures;
+    auto intern = [&](std::string_view spelling) {
+        CanonicalType type = resolver.resolve(spelling);
+        auto it = provisional.emplace(type.base, names.size()).first;
+        if (it->second == names.size()) names.push_back(type.base);
+        return SignatureIndex::code(it->second, type);
+    };
+    for (auto& unit : units) {
+        for (auto& fn : unit.entities.functions) {
+            std::vector<uint32_t> sig{ intern(fn.return_type) };
+            for (auto& arg : fn.args) sig.push_back(intern(arg.arg_type));
+            signatures.push_back(std::move(sig));
+        }
+    }
+
+    bases.build(names);
+    std::vector<uint32_t> renumber(names.size());
+    for (uint32_t i = 0; i < names.size(); ++i) renumber[i] = bases.find(names[i]);
+    for (auto& sig : signatures) {
+        for (auto& c : sig) c = renumber[c >> 8] << 8 | (c & 0xff);
+    }
+    index.build(signatures);
+}
+
+/** Every function within max_distance unification cost, for search() */
+struct RangeCollector {
+    int max;
+    std::vector<std::pair<int, size_t>> matches;
+
+    int cutoff() const { return max; }
+    void push(int score, size_t index) { if (score <= max) matches.emplace_back(score, index); }
+};
+
+/**
+ * Functions whose signature unifies with the structured query, cheapest
+ * first: the max_results best, or with max_distance >= 0 all of those
+ * costing at most that much.
+ */
+template<typename T>
+ScoreVec getSignatureScores(const T& ts, const SignatureIndex& index, const std::vector<uint32_t>& query,
+                            const SearchOptions& opts, int max_distance = -1) {
+    SourceOrder<T> order{&ts};
+    std::vector<std::pair<int, size_t>> matches;
+    if (max_distance >= 0) {
+        RangeCollector range{ max_distance };
+        index.search(query, range);
+        matches = std::move(range.matches);
+        std::sort(matches.begin(), matches.end(), [&](auto& a, auto& b) {
+            return a.first != b.first ? a.first < b.first : order(a.second, b.second);
+        });
+    } else {
+        TopK top(opts.max_results, order);
+        index.search(query, top);
+        matches = top.take();
+    }
+
+    ScoreVec scores;
+    for (auto& [score, i] : matches) {
+        scores.push_back({ i, score });
+    }
+    return scores;
+}
+
+bool isSourceFile(const std::filesystem::path& path) {
+    static const char* extensions[] = {
+        ".c", ".cc", ".cpp", ".cxx", ".h", ".hh", ".hpp", ".hxx"
+    };
+    std::string ext = path.extension().string();
+    return std::any_of(std::begin(extensions), std::end(extensions),
+                       [&](const char* e){ return ext == e; });
+}
+
+void expandSourceSpec(const std::string& spec, std::vector<std::string>& files) {
+    namespace fs = std::filesystem;
+
+    // @listfile: one source spec per line
+    if (spec.size() > 1 && spec[0] == '@') {
+        std::ifstream list(spec.substr(1));
+        if (!list) {
+            fprintf(stderr, "ERROR: could not open file list %s\n", spec.c_str() + 1);
+            return;
+        }
+        std::string line;
+        while (std::getline(list, line)) {
+            if (!line.empty()) expandSourceSpec(line, files);
+        }
+        return;
+    }
+
+    if (spec.find_first_of("*?[") != std::string::npos) {
+        glob_t matches;
+        if (glob(spec.c_str(), 0, NULL, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; ++i) {
+                expandSourceSpec(matches.gl_pathv[i], files);
+            }
+        }
+        globfree(&matches);
+        return;
+    }
+
+    std::error_code ec;
+    if (fs::is_directory(spec, ec)) {
+        for (auto& entry : fs::recursive_directory_iterator(spec, ec)) {
+            if (entry.is_regular_file(ec) && isSourceFile(entry.path())) {
+                files.push_back(entry.path().string());
+            }
+        }
+        return;
+    }
+
+    files.push_back(spec);
+}
+
+std::string cxstring(CXString str) {
+    return ScopedCXString(str).c_str();
+}
+
+/** Keep the flags that affect parsing, anchoring relative paths at the command's directory */
+ArgVec sanitizeCompileArgs(CXCompileCommand command) {
+    namespace fs = std::filesystem;
+    static const char* path_options[] = {
+        "-I", "-isystem", "-iquote", "-idirafter", "-include", "-imacros", "-isysroot", "--sysroot"
+    };
+    static const char* dropped_options[] = { "-o", "-MF", "-MT", "-MQ" };
+
+    fs::path directory = cxstring(clang_CompileCommand_getDirectory(command));
+    fs::path source = directory / cxstring(clang_CompileCommand_getFilename(command));
+    auto anchor = [&](const std::string& path) {
+        return fs::path(path).is_absolute() ? path : (directory / path).string();
+    };
+
+    ArgVec args;
+    unsigned n = clang_CompileCommand_getNumArgs(command);
+    // first argument is the compiler itself
+    for (unsigned i = 1; i < n; ++i) {
+        std::string arg = cxstring(clang_CompileCommand_getArg(command, i));
+
+        if (arg == "-c" || arg == "-MD" || arg == "-MMD") continue;
+        if (std::any_of(std::begin(dropped_options), std::end(dropped_options),
+                        [&](const char* o){ return arg == o; })) {
+            ++i;
+            continue;
+        }
+        if (arg[0] != '-' && fs::path(anchor(arg)).lexically_normal() == source.lexically_normal()) {
+            continue;
+        }
+
+        bool handled = false;
+        for (const char* option : path_options) {
+            size_t len = strlen(option);
+            if (arg == option && i + 1 < n) {
+                args.push_back(arg);
+                args.push_back(anchor(cxstring(clang_CompileCommand_getArg(command, ++i))));
+                handled = true;
+            }
+            else if (len == 2 && arg.size() > len && arg.compare(0, len, option) == 0) {
+                args.push_back(option + anchor(arg.substr(len)));
+                handled = true;
+            }
+            if (handled) break;
+        }
+        if (!handled) args.push_back(arg);
+    }
+    return args;
+}
+
+bool loadCompilationDatabase(const std::string& path, const std::vector<std::string>& files, Project& project) {
+    namespace fs = std::filesystem;
+    std::string directory = path;
+    if (fs::path(path).filename() == "compile_commands.json") {
+        directory = fs::path(path).parent_path().string();
+        if (directory.empty()) directory = ".";
+    }
+
+    CXCompilationDatabase_Error error;
+    CXCompilationDatabase db = clang_CompilationDatabase_fromDirectory(directory.c_str(), &error);
+    if (error != CXCompilationDatabase_NoError) {
+        fprintf(stderr, "ERROR: could not load compile_commands.json from %s\n", directory.c_str());
+        return false;
+    }
+
+    std::set<std::string> seen;
+    auto addCommand = [&](CXCompileCommand command) {
+        fs::path source = cxstring(clang_CompileCommand_getFilename(command));
+        if (source.is_relative()) {
+            source = cxstring(clang_CompileCommand_getDirectory(command)) / source;
+        }
+        // a file compiled several times is indexed with its first command
+        if (!seen.insert(source.lexically_normal().string()).second) return;
+        project.sources.push_back(SourceFile{
+            source.lexically_normal().string(),
+            project.internFlags(sanitizeCompileArgs(command))
+        });
+    };
+
+    if (files.empty()) {
+        CXCompileCommands commands = clang_CompilationDatabase_getAllCompileCommands(db);
+        for (unsigned i = 0; i < clang_CompileCommands_getSize(commands); ++i) {
+            addCommand(clang_CompileCommands_getCommand(commands, i));
+        }
+        clang_CompileCommands_dispose(commands);
+    }
+    else {
+        for (auto& file : files) {
+            std::string absolute = fs::absolute(file).lexically_normal().string();
+            CXCompileCommands commands = clang_CompilationDatabase_getCompileCommands(db, absolute.c_str());
+            // files without an entry are parsed without flags
+            if (commands != 0 && clang_CompileCommands_getSize(commands) > 0) {
+                addCommand(clang_CompileCommands_getCommand(commands, 0));
+            } else {
+                project.sources.push_back(SourceFile{ file, 0 });
+            }
+            clang_CompileCommands_dispose(commands);
+        }
+    }
+
+    clang_CompilationDatabase_dispose(db);
+    return true;
+}
+
+bool stampFile(const std::string& filename, FileStamp& stamp, bool with_hash = true) {
+    stamp.filename = filename;
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+    stamp.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    if (!with_hash) {
+        return true;
+    }
+
+    FILE* in = fopen(filename.c_str(), "rb");
+    if (in == NULL) {
+        return false;
+    }
+    uint64_t hash = 14695981039346656037ull;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ull;
+        }
+    }
+    fclose(in);
+    stamp.hash = hash;
+    return true;
+}
+
+void inclusionVisitor(CXFile included_file, CXSourceLocation* inclusion_stack,
+                      unsigned include_len, CXClientData client_data) {
+    // the main file is reported with an empty inclusion stack
+    if (include_len == 0) return;
+    std::string filename = cxstring(clang_getFileName(included_file));
+    ((std::set<std::string>*)client_data)->insert(
+        std::filesystem::absolute(filename).lexically_normal().string());
+}
+
+bool isCxxSource(const std::string& filename) {
+    static const char* extensions[] = { ".cc", ".cpp", ".cxx", ".hh", ".hpp", ".hxx" };
+    std::string ext = std::filesystem::path(filename).extension().string();
+    return std::any_of(std::begin(extensions), std::end(extensions),
+                       [&](const char* e){ return ext == e; });
+}
+
+/**
+ * Hash of the flags that can change what a header declares: macro
+ * definitions, the language and its standard, and forced includes. Units
+ * that agree on these see the same declarations from a header.
+ */
+std::string headerMacroKey(const IndexUnit& unit) {
+    static const char* relevant[] = { "-D", "-U", "-std", "-x", "-include", "-ansi" };
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](const std::string& s) {
+        for (char c : s) {
+            hash ^= (unsigned char)c;
+            hash *= 1099511628211ull;
+        }
+        hash ^= 0xff;
+        hash *= 1099511628211ull;
+    };
+    mix(isCxxSource(unit.source.filename) ? "c++" : "c");
+    for (size_t i = 0; i < unit.flags.size(); ++i) {
+        const std::string& flag = unit.flags[i];
+        bool matches = std::any_of(std::begin(relevant), std::end(relevant),
+                                   [&](const char* r){ return flag.compare(0, strlen(r), r) == 0; });
+        if (!matches) continue;
+        mix(flag);
+        // "-D NAME" and friends: the value is the next argument
+        bool separate = flag == "-D" || flag == "-U" || flag == "-x" || flag == "-include";
+        if (separate && i + 1 < unit.flags.size()) mix(unit.flags[++i]);
+    }
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    return key;
+}
+
+enum class ParseProfile { Declarations, Full };
+enum class ParseEngine { Visitor, Indexer };
+
+/** How sources are parsed and what is collected from them */
+struct ParseOptions {
+    ParseProfile profile = ParseProfile::Declarations;
+    ParseEngine engine = ParseEngine::Visitor;
+    bool shared_pch = false;    // see buildSharedPchs
+    bool headers = false;       // collect project headers too, see HeaderClaims
+};
+
+/**
+ * Only declarations are collected, so by default libclang skips function
+ * bodies and the template instantiations at the end of the unit, and keeps
+ * going past errors instead of stopping at the first missing header.
+ * cursorVisitor never enters a function body, so nothing is lost; the full
+ * profile is the plain parse, for comparison.
+ */
+unsigned parseFlags(ParseProfile profile) {
+    if (profile == ParseProfile::Full) return CXTranslationUnit_None;
+    return CXTranslationUnit_SkipFunctionBodies | CXTranslationUnit_Incomplete | CXTranslationUnit_KeepGoing;
+}
+
+/** A precompiled header shared by the units with the same flags and language */
+struct SharedPch {
+    std::string path;
+    std::vector<FileStamp> deps;    // headers compiled into it
+};
+
+/** libclang state of one parser thread */
+struct ParseSession {
+    CXIndex index = NULL;
+    CXIndexAction action = NULL;    // ParseEngine::Indexer only; bodies seen once are skipped after
+};
+
+/** The indexer reports declarations only, so there's no walk over statements and expressions */
+void indexDeclaration(CXClientData client_data, const CXIdxDeclInfo* info) {
+    cursorVisitor(info->cursor, clang_getNullCursor(), client_data);
+}
+
+/** Parse unit, with pch if not NULL, and collect its entities into context */
+CXTranslationUnit collectTranslationUnit(ParseSession& session, const IndexUnit& unit, const ParseOptions& parsing,
+                                         const SharedPch* pch, VisitContext& context) {
+    std::vector<const char*> args;
+    for (auto& flag : unit.flags) {
+        args.push_back(flag.c_str());
+    }
+    if (pch != NULL) {
+        args.push_back("-include-pch");
+        args.push_back(pch->path.c_str());
+    }
+
+    const std::string& filename = unit.source.filename;
+    CXTranslationUnit translation_unit = NULL;
+    if (session.action != NULL) {
+        IndexerCallbacks callbacks = {};
+        callbacks.indexDeclaration = indexDeclaration;
+        unsigned options = CXIndexOpt_SkipParsedBodiesInSession | CXIndexOpt_SuppressWarnings;
+        // the callbacks run during the parse, so their time counts as parsing
+        uint64_t start = threadCpuNs();
+        int error = clang_indexSourceFile(session.action, &context, &callbacks, sizeof(callbacks), options,
+                                          filename.c_str(), args.data(), args.size(), NULL, 0,
+                                          &translation_unit, parseFlags(parsing.profile));
+        ThreadStats::local().parse_ns += threadCpuNs() - start;
+        if (error != 0 && translation_unit != NULL) {
+            clang_disposeTranslationUnit(translation_unit);
+            translation_unit = NULL;
+        }
+        return translation_unit;
+    }
+
+    // clang_parseTranslationUnit(CXIndex CIdx,
+    //                        const char *source_filename,
+    //                        const char *const *command_line_args,
+    //                        int num_command_line_args,
+    //                        struct CXUnsavedFile *unsaved_files,
+    //                        unsigned num_unsaved_files,
+    //                        unsigned options);
+    StatCounters& stats = ThreadStats::local();
+    uint64_t start = threadCpuNs();
+    translation_unit = clang_parseTranslationUnit(
+        session.index, filename.c_str(), args.data(), args.size(), NULL, 0, parseFlags(parsing.profile));
+    uint64_t parsed = threadCpuNs();
+    stats.parse_ns += parsed - start;
+    if (translation_unit != NULL) {
+        CXCursor root_cursor = clang_getTranslationUnitCursor(translation_unit);
+        clang_visitChildren(root_cursor, *cursorVisitor, (CXClientData*)&context);
+        stats.collect_ns += threadCpuNs() - parsed;
+    }
+    return translation_unit;
+}
+
+bool parseSourceFile(ParseSession& session, IndexUnit& unit, const ParseOptions& parsing,
+                     const SharedPch* pch = NULL, HeaderClaims* claims = NULL) {
+    const std::string& filename = unit.source.filename;
+    unit.releaseEntities();
+    unit.claimed.clear();
+    VisitContext context;
+    context.entities = &unit.entities;
+    context.claims = claims;
+    context.claimed = &unit.claimed;
+    if (claims != NULL) context.macro_key = headerMacroKey(unit);
+
+    CXTranslationUnit translation_unit = collectTranslationUnit(session, unit, parsing, pch, context);
+    if (translation_unit == NULL && pch != NULL) {
+        // the indexer may have collected part of the unit before failing; headers it claimed stay ours
+        unit.releaseEntities();
+        context.owned.clear();
+        pch = NULL;
+        translation_unit = collectTranslationUnit(session, unit, parsing, pch, context);
+    }
+    if (translation_unit == NULL) {
+        fprintf(stderr, "ERROR: %s() failed for %s\n",
+                session.action != NULL ? "clang_indexSourceFile" : "clang_parseTranslationUnit", filename.c_str());
+        return false;
+    }
+
+    // headers inside the PCH aren't reported as inclusions, but changes to them still matter
+    std::set<std::string> includes;
+    clang_getInclusions(translation_unit, inclusionVisitor, &includes);
+    unit.deps.clear();
+    if (pch != NULL) {
+        for (auto& dep : pch->deps) {
+            includes.erase(dep.filename);
+            unit.deps.push_back(dep);
+        }
+    }
+    for (auto& include : includes) {
+        unit.deps.emplace_back();
+        stampFile(include, unit.deps.back());
+    }
+    stampFile(filename, unit.source);
+
+    clang_disposeTranslationUnit(translation_unit);
+    return true;
+}
+
+/**
+ * The #include <...> lines a source starts with, up to the first line of
+ * anything else. Units built with the same flags tend to share a good part
+ * of these, and system headers are what's worth precompiling.
+ */
+std::vector<std::string> leadingSystemIncludes(const std::string& filename) {
+    std::vector<std::string> includes;
+    std::ifstream in(filename);
+    std::string line;
+    bool in_comment = false;
+    while (std::getline(in, line)) {
+        std::string_view rest(line);
+        if (in_comment) {
+            size_t end = rest.find("*/");
+            if (end == std::string_view::npos) continue;
+            in_comment = false;
+            rest.remove_prefix(end + 2);
+        }
+        size_t at = rest.find_first_not_of(" \t\r");
+        if (at == std::string_view::npos) continue;
+        rest.remove_prefix(at);
+        if (rest.substr(0, 2) == "//") continue;
+        if (rest.substr(0, 2) == "/*") {
+            in_comment = rest.find("*/", 2) == std::string_view::npos;
+            continue;
+        }
+        if (rest[0] != '#') break;
+
+        size_t name = rest.find_first_not_of(" \t", 1);
+        if (name == std::string_view::npos) continue;
+        std::string_view directive = rest.substr(name);
+        if (directive.substr(0, 11) == "pragma once") continue;
+        if (directive.substr(0, 7) != "include") break;
+        size_t open = directive.find('<');
+        size_t close = directive.find('>');
+        if (open == std::string_view::npos || close == std::string_view::npos || close < open) break;
+        includes.push_back("#include " + std::string(directive.substr(open, close - open + 1)));
+    }
+    return includes;
+}
+
+/** What systemInclusionVisitor checks the headers of */
+struct SystemHeaderCheck {
+    CXTranslationUnit translation_unit;
+    bool all_system = true;
+};
+
+void systemInclusionVisitor(CXFile included_file, CXSourceLocation* inclusion_stack,
+                            unsigned include_len, CXClientData client_data) {
+    if (include_len == 0) return;
+    SystemHeaderCheck* check = (SystemHeaderCheck*)client_data;
+    CXSourceLocation start = clang_getLocation(check->translation_unit, included_file, 1, 1);
+    if (clang_Location_isInSystemHeader(start) == 0) check->all_system = false;
+}
+
+/**
+ * Declarations inside a PCH are invisible to the parsers (see collectEntities),
+ * so a PCH is only built if everything it pulls in is a system header: a
+ * project header included with <...> through -I would silently lose its
+ * entities with --headers.
+ */
+bool buildSharedPch(CXIndex index, const ArgVec& flags, bool cxx, const std::vector<std::string>& includes,
+                    const std::string& header, SharedPch& pch) {
+    {
+        std::ofstream out(header);
+        for (auto& include : includes) out << include << "\n";
+        if (!out) return false;
+    }
+
+    std::vector<const char*> args;
+    for (auto& flag : flags) {
+        args.push_back(flag.c_str());
+    }
+    args.push_back("-x");
+    args.push_back(cxx ? "c++-header" : "c-header");
+    CXTranslationUnit translation_unit = clang_parseTranslationUnit(
+        index, header.c_str(), args.data(), args.size(), NULL, 0,
+        CXTranslationUnit_Incomplete | CXTranslationUnit_ForSerialization);
+    if (translation_unit == 0) {
+        return false;
+    }
+    SystemHeaderCheck check{ translation_unit };
+    clang_getInclusions(translation_unit, systemInclusionVisitor, &check);
+    if (!check.all_system) {
+        clang_disposeTranslationUnit(translation_unit);
+        return false;
+    }
+
+    pch.path = header + ".pch";
+    bool saved = clang_saveTranslationUnit(translation_unit, pch.path.c_str(),
+                                           clang_defaultSaveOptions(translation_unit)) == CXSaveError_None;
+    std::set<std::string> headers;
+    clang_getInclusions(translation_unit, inclusionVisitor, &headers);
+    for (auto& h : headers) {
+        pch.deps.emplace_back();
+        stampFile(h, pch.deps.back());
+    }
+    clang_disposeTranslationUnit(translation_unit);
+    return saved;
+}
+
+/**
+ * Precompiles the system headers that every todo unit with the same flags
+ * and language starts with, one PCH per such group, so they are parsed once
+ * per group instead of once per unit. Sets unit_pch[i] to the PCH of
+ * units[i] (or -1) and returns the directory holding the PCHs, empty if
+ * there are none.
+ */
+std::string buildSharedPchs(const std::vector<IndexUnit>& units, const std::vector<size_t>& todo, unsigned jobs,
+                            std::vector<SharedPch>& pchs, std::vector<int>& unit_pch) {
+    struct Group {
+        std::vector<size_t> members;
+        std::vector<std::string> includes;
+    };
+    std::map<std::pair<ArgVec, bool>, Group> groups;
+    for (size_t i : todo) {
+        const IndexUnit& unit = units[i];
+        // an explicit -x would fight with the header language below
+        if (std::find(unit.flags.begin(), unit.flags.end(), "-x") != unit.flags.end()) continue;
+        Group& group = groups[{ unit.flags, isCxxSource(unit.source.filename) }];
+        std::vector<std::string> includes = leadingSystemIncludes(unit.source.filename);
+        if (group.members.empty()) {
+            group.includes = std::move(includes);
+        } else {
+            auto mismatch = std::mismatch(group.includes.begin(), group.includes.end(),
+                                          includes.begin(), includes.end());
+            group.includes.erase(mismatch.first, group.includes.end());
+        }
+        group.members.push_back(i);
+    }
+
+    std::vector<std::pair<const std::pair<ArgVec, bool>*, const Group*>> plans;
+    for (auto& [key, group] : groups) {
+        if (group.members.size() >= 2 && !group.includes.empty()) plans.emplace_back(&key, &group);
+    }
+    unit_pch.assign(units.size(), -1);
+    if (plans.empty()) return "";
+
+    std::error_code error;
+    std::string dir = (std::filesystem::temp_directory_path(error) /
+                       ("seapeapea-pch-" + std::to_string(getpid()))).string();
+    if (error || !std::filesystem::create_directories(dir, error)) return "";
+
+    pchs.assign(plans.size(), SharedPch());
+    std::vector<char> built(plans.size(), 0);
+    std::atomic<size_t> next_plan{0};
+    auto worker = [&]() {
+        CXIndex index = clang_createIndex(0, 0);
+        if (index == 0) return;
+        for (size_t p = next_plan++; p < plans.size(); p = next_plan++) {
+            auto& [key, group] = plans[p];
+            std::string header = dir + "/shared" + std::to_string(p) + (key->second ? ".hpp" : ".h");
+            built[p] = buildSharedPch(index, key->first, key->second, group->includes, header, pchs[p]);
+        }
+        clang_disposeIndex(index);
+    };
+
+    jobs = std::max(1u, std::min<unsigned>(jobs, plans.size()));
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    size_t covered = 0, count = 0;
+    for (size_t p = 0; p < plans.size(); ++p) {
+        if (!built[p]) continue;
+        ++count;
+        for (size_t i : plans[p].second->members) unit_pch[i] = p;
+        covered += plans[p].second->members.size();
+    }
+    fprintf(stderr, "precompiled %zu shared headers for %zu translation units\n", count, covered);
+    return dir;
+}
+
+/** Parse the todo units on a pool of worker threads, each owning its own CXIndex */
+bool collectEntities(std::vector<IndexUnit>& units, const std::vector<size_t>& todo, unsigned jobs,
+                     const ParseOptions& parsing = ParseOptions()) {
+    std::vector<SharedPch> pchs;
+    std::vector<int> unit_pch(units.size(), -1);
+    std::string pch_dir;
+    if (parsing.shared_pch) {
+        pch_dir = buildSharedPchs(units, todo, jobs, pchs, unit_pch);
+    }
+
+    // headers owned by units that aren't re-parsed stay theirs
+    HeaderClaims claims;
+    if (parsing.headers) {
+        std::vector<bool> parsed(units.size(), false);
+        for (size_t i : todo) parsed[i] = true;
+        for (size_t i = 0; i < units.size(); ++i) {
+            if (parsed[i]) continue;
+            for (auto& key : units[i].claimed) claims.claim(key);
+        }
+    }
+
+    std::atomic<size_t> next_file{0};
+    std::atomic<bool> ok{true};
+
+    auto worker = [&]() {
+        // clang_createIndex(1, 0): the first argument excludes declarations from a shared PCH, which
+        // holds system headers only (see buildSharedPch) and those are never collected; the second
+        // keeps diagnostics quiet, so a broken include doesn't drown the results
+        ParseSession session;
+        session.index = clang_createIndex(1, 0);
+        if (session.index == 0) {
+            fprintf(stderr, "ERROR: clang_createIndex() failed\n");
+            ok = false;
+            return;
+        }
+        // one indexing session per thread, so headers seen by its earlier units aren't parsed again
+        if (parsing.engine == ParseEngine::Indexer) {
+            session.action = clang_IndexAction_create(session.index);
+        }
+        for (size_t i = next_file++; i < todo.size(); i = next_file++) {
+            int pch = unit_pch[todo[i]];
+            // a unit that failed has no entities or stamps, so saving it would hide it from update
+            if (!parseSourceFile(session, units[todo[i]], parsing, pch >= 0 ? &pchs[pch] : NULL,
+                                 parsing.headers ? &claims : NULL)) {
+                ok = false;
+            }
+        }
+        if (session.action != NULL) {
+            clang_IndexAction_dispose(session.action);
+        }
+        clang_disposeIndex(session.index);
+    };
+
+    jobs = std::max(1u, std::min<unsigned>(jobs, todo.size()));
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    if (!pch_dir.empty()) {
+        std::error_code error;
+        std::filesystem::remove_all(pch_dir, error);
+    }
+    return ok;
+}
+
+/*
+ * Index file layout (native endianness, all fields 32-bit unless noted):
+ *
+ *   char magic[8], version, section_count
+ *   section_count x { tag, reserved, u64 offset, u64 size }
+ *   sections, each 8-byte aligned
+ *
+ * STRS: count, offsets[count+1], bytes    -- every string is stored once
+ * UNIT: count, then per translation unit:
+ *         source stamp, flags, dependency stamps, claimed header keys,
+ *         entity counts, entities      -- strings are STRS ids
+ *
+ * A stamp is { filename, u64 mtime, u64 hash }, 64-bit values as two words.
+ *
+ * QGFN, QGTD, QGST, QGCL: optional QGramIndex over the normal() strings of
+ * all functions, typedefs, structs and classes, in unit order.
+ * BKFN, BKTD, BKST, BKCL: optional BKTree over the same strings.
+ * TKVC: optional TokenVocabulary of the tokens of all those strings.
+ * TKFN, TKTD, TKST, TKCL: optional TokenSequences of the same strings.
+ * SGVC, SGIX: optional base type names and SignatureIndex of all functions.
+ * PRSE: parse profile, engine and whether headers were collected, so update
+ * can tell whether the saved units match its own options.
+ */
+constexpr char kIndexMagic[8] = { 'S', 'P', 'P', 'I', 'N', 'D', 'E', 'X' };
+constexpr uint32_t kIndexVersion = 4;
+
+constexpr uint32_t fourcc(const char (&tag)[5]) {
+    return (uint32_t)tag[0] | (uint32_t)tag[1] << 8 | (uint32_t)tag[2] << 16 | (uint32_t)tag[3] << 24;
+}
+
+constexpr uint32_t kStringsSection = fourcc("STRS");
+constexpr uint32_t kUnitsSection = fourcc("UNIT");
+constexpr uint32_t kPrefilterSections[kEntityKinds] = {
+    fourcc("QGFN"), fourcc("QGTD"), fourcc("QGST"), fourcc("QGCL")
+};
+constexpr uint32_t kBKTreeSections[kEntityKinds] = {
+    fourcc("BKFN"), fourcc("BKTD"), fourcc("BKST"), fourcc("BKCL")
+};
+constexpr uint32_t kTokenVocabularySection = fourcc("TKVC");
+constexpr uint32_t kTokenSections[kEntityKinds] = {
+    fourcc("TKFN"), fourcc("TKTD"), fourcc("TKST"), fourcc("TKCL")
+};
+constexpr uint32_t kSignatureBasesSection = fourcc("SGVC");
+constexpr uint32_t kSignatureSection = fourcc("SGIX");
+constexpr uint32_t kParseOptionsSection = fourcc("PRSE");
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+};
+
+struct IndexSection {
+    uint32_t tag;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+class IndexWriter {
+public:
+    void addUnit(const IndexUnit& unit) {
+        ++unit_count;
+        stamp(unit.source);
+        u32(unit.flags.size());
+        for (auto& flag : unit.flags) u32(str(flag));
+        u32(unit.deps.size());
+        for (auto& dep : unit.deps) stamp(dep);
+        u32(unit.claimed.size());
+        for (auto& key : unit.claimed) u32(str(key));
+        const EntityAggregate& e = unit.entities;
+        u32(e.functions.size());
+        u32(e.typedefs.size());
+        u32(e.structs.size());
+        u32(e.classes.size());
+        for (auto& fn : e.functions) function(fn);
+        for (auto& td : e.typedefs) { loc(td.source); u32(str(td.alias)); u32(str(td.aliased)); }
+        for (auto& st : e.structs) { loc(st.source); u32(str(st.struct_name)); attributes(st.attributes); }
+        for (auto& cl : e.classes) {
+            loc(cl.source);
+            u32(str(cl.class_name));
+            attributes(cl.attributes);
+            u32(cl.methods.size());
+            for (auto& fn : cl.methods) function(fn);
+        }
+    }
+
+    /** Queue an optional section, written after the string table and units by save() */
+    void addSection(uint32_t tag, const std::vector<uint32_t>& words) {
+        extra_sections.push_back({ tag, std::string((const char*)words.data(), words.size() * sizeof(uint32_t)) });
+    }
+
+    /** Write to a temporary file and rename it so readers never see a partial index */
+    bool save(const std::string& path) const {
+        std::vector<uint32_t> string_offsets;
+        string_offsets.push_back(strings.size());
+        uint32_t offset = 0;
+        for (auto& s : strings) {
+            string_offsets.push_back(offset);
+            offset += s.size();
+        }
+        string_offsets.push_back(offset);
+
+        std::vector<Blob> blobs;
+        blobs.push_back({ kStringsSection, std::string((const char*)string_offsets.data(),
+                                                       string_offsets.size() * sizeof(uint32_t)) });
+        blobs[0].bytes.reserve(blobs[0].bytes.size() + offset);
+        for (auto& s : strings) blobs[0].bytes += s;
+
+        blobs.push_back({ kUnitsSection, std::string((const char*)&unit_count, sizeof(uint32_t)) });
+        blobs[1].bytes.append((const char*)units.data(), units.size() * sizeof(uint32_t));
+        blobs.insert(blobs.end(), extra_sections.begin(), extra_sections.end());
+
+        IndexHeader header;
+        memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+        header.version = kIndexVersion;
+        header.section_count = blobs.size();
+
+        std::vector<IndexSection> sections;
+        uint64_t next = align(sizeof(header) + blobs.size() * sizeof(IndexSection));
+        for (auto& blob : blobs) {
+            sections.push_back({ blob.tag, 0, next, blob.bytes.size() });
+            next = align(next + blob.bytes.size());
+        }
+
+        std::string tmp = path + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "wb");
+        if (out == NULL) {
+            fprintf(stderr, "ERROR: could not write %s\n", tmp.c_str());
+            return false;
+        }
+
+        bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+               && fwrite(sections.data(), sizeof(IndexSection), sections.size(), out) == sections.size();
+        uint64_t written = sizeof(header) + sections.size() * sizeof(IndexSection);
+        for (size_t i = 0; i < blobs.size(); ++i) {
+            static const char zeros[8] = {};
+            size_t padding = sections[i].offset - written;
+            ok = ok && fwrite(zeros, 1, padding, out) == padding
+                    && fwrite(blobs[i].bytes.data(), 1, blobs[i].bytes.size(), out) == blobs[i].bytes.size();
+            written = sections[i].offset + blobs[i].bytes.size();
+        }
+
+        ok = (fclose(out) == 0) && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            fprintf(stderr, "ERROR: could not write %s\n", path.c_str());
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static uint64_t align(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+
+    void u32(uint32_t value) { units.push_back(value); }
+    void u64(uint64_t value) { u32(value & 0xffffffff); u32(value >> 32); }
+
+    uint32_t str(std::string_view s) {
+        auto it = string_ids.emplace(s, strings.size());
+        if (it.second) strings.emplace_back(s);
+        return it.first->second;
+    }
+
+    void loc(const SourceLoc& source) {
+        u32(str(source.filename));
+        u32(source.line);
+        u32(source.col);
+    }
+
+    void stamp(const FileStamp& stamp) {
+        u32(str(stamp.filename));
+        u64(stamp.mtime);
+        u64(stamp.hash);
+    }
+
+    void function(const Function& fn) {
+        loc(fn.source);
+        u32(str(fn.return_type));
+        u32(str(fn.function_name));
+        u32(fn.args.size());
+        for (auto& arg : fn.args) { u32(str(arg.arg_name)); u32(str(arg.arg_type)); }
+    }
+
+    void attributes(const std::pmr::vector<Attribute>& attrs) {
+        u32(attrs.size());
+        for (auto& attr : attrs) { u32(str(attr.attr_name)); u32(str(attr.attr_type)); }
+    }
+
+    struct Blob {
+        uint32_t tag;
+        std::string bytes;
+    };
+
+    std::vector<uint32_t> units;
+    uint32_t unit_count = 0;
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, uint32_t> string_ids;
+    std::vector<Blob> extra_sections;
+};
+
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_ != NULL) munmap(data_, size_);
+    }
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) return false;
+        data_ = data;
+        size_ = st.st_size;
+        return true;
+    }
+
+    const char* data() const { return (const char*)data_; }
+    size_t size() const { return size_; }
+
+private:
+    void* data_ = NULL;
+    size_t size_ = 0;
+};
+
+class IndexReader {
+public:
+    bool open(const std::string& path) {
+        if (!file.open(path)) {
+            fprintf(stderr, "ERROR: could not open index %s\n", path.c_str());
+            return false;
+        }
+        const IndexHeader* header = (const IndexHeader*)file.data();
+        if (file.size() < sizeof(IndexHeader)
+            || memcmp(header->magic, kIndexMagic, sizeof(kIndexMagic)) != 0
+            || header->version != kIndexVersion
+            || (file.size() - sizeof(IndexHeader)) / sizeof(IndexSection) < header->section_count) {
+            fprintf(stderr, "ERROR: %s is not a seapeapea index (version %u)\n", path.c_str(), kIndexVersion);
+            return false;
+        }
+        sections = (const IndexSection*)(file.data() + sizeof(IndexHeader));
+        section_count = header->section_count;
+
+        const IndexSection* strings = find(kStringsSection);
+        size_t words = strings != NULL ? strings->size / sizeof(uint32_t) : 0;
+        const uint32_t* strs = strings != NULL ? (const uint32_t*)(file.data() + strings->offset) : NULL;
+        if (strs == NULL || words < 2 || words - 2 < strs[0]) {
+            fprintf(stderr, "ERROR: index %s has no string table\n", path.c_str());
+            return false;
+        }
+        string_count = strs[0];
+        string_offsets = strs + 1;
+        string_bytes = (const char*)(strs + string_count + 2);
+        // offsets must ascend within the bytes, so string() never has to check them
+        size_t bytes = strings->size - (string_count + 2) * sizeof(uint32_t);
+        bool ascending = string_offsets[string_count] <= bytes;
+        for (uint32_t i = 0; ascending && i < string_count; ++i) {
+            ascending = string_offsets[i] <= string_offsets[i + 1];
+        }
+        if (!ascending) {
+            fprintf(stderr, "ERROR: index %s is corrupt\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /** Section contents as 32-bit words, NULL if missing or out of bounds */
+    const uint32_t* section(uint32_t tag, size_t* words) const {
+        const IndexSection* s = find(tag);
+        if (s == NULL) return NULL;
+        *words = s->size / sizeof(uint32_t);
+        return (const uint32_t*)(file.data() + s->offset);
+    }
+
+    bool validString(uint32_t id) const { return id < string_count; }
+
+    std::string_view string(uint32_t id) const {
+        return std::string_view(string_bytes + string_offsets[id],
+                                string_offsets[id + 1] - string_offsets[id]);
+    }
+
+private:
+    /** The first section with tag that is aligned and lies inside the file */
+    const IndexSection* find(uint32_t tag) const {
+        for (uint32_t i = 0; i < section_count; ++i) {
+            const IndexSection& s = sections[i];
+            if (s.tag == tag && s.offset % sizeof(uint32_t) == 0
+                && s.offset <= file.size() && s.size <= file.size() - s.offset) {
+                return &s;
+            }
+        }
+        return NULL;
+    }
+
+    MappedFile file;
+    const IndexSection* sections = NULL;
+    uint32_t section_count = 0;
+    uint32_t string_count = 0;
+    const uint32_t* string_offsets = NULL;
+    const char* string_bytes = NULL;
+};
+
+/** Bounds-checked decoder over one index section */
+class IndexCursor {
+public:
+    IndexCursor(const IndexReader& reader_, const uint32_t* begin, size_t words)
+    : reader(reader_), pos(begin), end(begin + words) {}
+
+    bool ok() const { return ok_; }
+
+    uint32_t u32() {
+        if (pos >= end) { ok_ = false; return 0; }
+        return *pos++;
+    }
+
+    uint64_t u64() {
+        uint64_t low = u32();
+        return low | (uint64_t)u32() << 32;
+    }
+
+    std::string str() {
+        uint32_t id = u32();
+        if (!reader.validString(id)) { ok_ = false; return std::string(); }
+        return std::string(reader.string(id));
+    }
+
+    bool unit(IndexUnit& unit) {
+        stamp(unit.source);
+        unit.flags.resize(count());
+        for (auto& flag : unit.flags) flag = str();
+        unit.deps.resize(count());
+        for (auto& dep : unit.deps) stamp(dep);
+        unit.claimed.resize(count());
+        for (auto& key : unit.claimed) key = str();
+        EntityAggregate& e = unit.entities;
+        e.functions.resize(count());
+        e.typedefs.resize(count());
+        e.structs.resize(count());
+        e.classes.resize(count());
+        for (auto& fn : e.functions) function(fn);
+        for (auto& td : e.typedefs) { loc(td.source); td.alias = str(); td.aliased = str(); }
+        for (auto& st : e.structs) { loc(st.source); st.struct_name = str(); attributes(st.attributes); }
+        for (auto& cl : e.classes) {
+            loc(cl.source);
+            cl.class_name = str();
+            attributes(cl.attributes);
+            cl.methods.resize(count());
+            for (auto& fn : cl.methods) function(fn);
+        }
+        return ok_;
+    }
+
+private:
+    /** Element counts can't exceed the words left, which guards resize() against corrupt files */
+    uint32_t count() {
+        uint32_t n = u32();
+        if (n > (size_t)(end - pos)) { ok_ = false; return 0; }
+        return n;
+    }
+
+    void loc(SourceLoc& source) {
+        source.filename = str();
+        source.line = u32();
+        source.col = u32();
+    }
+
+    void stamp(FileStamp& stamp) {
+        stamp.filename = str();
+        stamp.mtime = u64();
+        stamp.hash = u64();
+    }
+
+    void function(Function& fn) {
+        loc(fn.source);
+        fn.return_type = str();
+        fn.function_name = str();
+        fn.args.resize(count());
+        for (auto& arg : fn.args) { arg.arg_name = str(); arg.arg_type = str(); }
+    }
+
+    void attributes(std::pmr::vector<Attribute>& attrs) {
+        attrs.resize(count());
+        for (auto& attr : attrs) { attr.attr_name = str(); attr.attr_type = str(); }
+    }
+
+    const IndexReader& reader;
+    const uint32_t* pos;
+    const uint32_t* end;
+    bool ok_ = true;
+};
+
+template<typename T>
+std::vector<std::string> normals(const std::vector<IndexUnit>& units, T EntityAggregate::*member) {
+    std::vector<std::string> strings;
+    for (auto& unit : units) {
+        for (auto& t : unit.entities.*member) {
+            strings.push_back(t.normal());
+        }
+    }
+    return strings;
+}
+
+void normals(const std::vector<IndexUnit>& units, std::vector<std::string> (&strings)[kEntityKinds]) {
+    strings[kFunctions] = normals(units, &EntityAggregate::functions);
+    strings[kTypedefs] = normals(units, &EntityAggregate::typedefs);
+    strings[kStructs] = normals(units, &EntityAggregate::structs);
+    strings[kClasses] = normals(units, &EntityAggregate::classes);
+}
+
+/** Tokenizes the normal() strings of every kind, interning the tokens in one vocabulary */
+void buildTokenIndexes(const std::vector<std::string> (&strings)[kEntityKinds],
+                       TokenVocabulary& vocabulary, TokenSequences (&sequences)[kEntityKinds]) {
+    std::vector<TokenVec> tokens[kEntityKinds];
+    std::vector<std::string> all;
+    for (int kind = 0; kind < kEntityKinds; ++kind) {
+        tokens[kind].reserve(strings[kind].size());
+        for (auto& s : strings[kind]) {
+            tokens[kind].push_back(tokenizeQuery(s));
+            all.insert(all.end(), tokens[kind].back().begin(), tokens[kind].back().end());
+        }
+    }
+    vocabulary.build(std::move(all));
+    for (int kind = 0; kind < kEntityKinds; ++kind) {
+        sequences[kind].build(tokens[kind], vocabulary);
+    }
+}
+
+bool saveIndex(const std::string& path, const std::vector<IndexUnit>& units, const ParseOptions& parsing) {
+    IndexWriter writer;
+    for (auto& unit : units) {
+        writer.addUnit(unit);
+    }
+    writer.addSection(kParseOptionsSection, { (uint32_t)parsing.profile, (uint32_t)parsing.engine,
+                                              (uint32_t)parsing.headers });
+
+    std::vector<std::string> strings[kEntityKinds];
+    normals(units, strings);
+    TokenVocabulary vocabulary;
+    TokenSequences sequences[kEntityKinds];
+    buildTokenIndexes(strings, vocabulary, sequences);
+    writer.addSection(kTokenVocabularySection, vocabulary.words());
+    TokenVocabulary bases;
+    SignatureIndex signatures;
+    buildSignatureIndex(units, bases, signatures);
+    writer.addSection(kSignatureBasesSection, bases.words());
+    writer.addSection(kSignatureSection, signatures.words());
+    for (int kind = 0; kind < kEntityKinds; ++kind) {
+        writer.addSection(kTokenSections[kind], sequences[kind].words());
+        QGramIndex prefilter;
+        prefilter.build(strings[kind]);
+        writer.addSection(kPrefilterSections[kind], prefilter.words());
+        BKTree tree;
+        tree.build(strings[kind]);
+        writer.addSection(kBKTreeSections[kind], tree.words());
+    }
+
+    return writer.save(path);
+}
+
+/** The options that decide what the saved units hold; false if the index doesn't say */
+bool loadParseOptions(const IndexReader& reader, ParseOptions& parsing) {
+    size_t words;
+    const uint32_t* data = reader.section(kParseOptionsSection, &words);
+    if (data == NULL || words < 3 || data[0] > (uint32_t)ParseProfile::Full
+        || data[1] > (uint32_t)ParseEngine::Indexer || data[2] > 1) {
+        return false;
+    }
+    parsing.profile = (ParseProfile)data[0];
+    parsing.engine = (ParseEngine)data[1];
+    parsing.headers = data[2] != 0;
+    return true;
+}
+
+/** Search structures are optional; a missing or damaged one just means a linear scan */
+void loadSearchIndexes(const IndexReader& reader, QGramIndex (&prefilters)[kEntityKinds],
+                       BKTree (&trees)[kEntityKinds]) {
+    for (int kind = 0; kind < kEntityKinds; ++kind) {
+        size_t words;
+        const uint32_t* data = reader.section(kPrefilterSections[kind], &words);
+        prefilters[kind].load(data, data ? words : 0);
+        data = reader.section(kBKTreeSections[kind], &words);
+        trees[kind].load(data, data ? words : 0);
+    }
+}
+
+/** Token sequences are only usable together with the vocabulary they were built with */
+bool loadTokenIndexes(const IndexReader& reader, const std::vector<IndexUnit>& units,
+                      TokenVocabulary& vocabulary, TokenSequences (&sequences)[kEntityKinds]) {
+    size_t counts[kEntityKinds] = {};
+    for (auto& unit : units) {
+        counts[kFunctions] += unit.entities.functions.size();
+        counts[kTypedefs] += unit.entities.typedefs.size();
+        counts[kStructs] += unit.entities.structs.size();
+        counts[kClasses] += unit.entities.classes.size();
+    }
+
+    size_t words;
+    const uint32_t* data = reader.section(kTokenVocabularySection, &words);
+    if (!vocabulary.load(data, data ? words : 0)) return false;
+    for (int kind = 0; kind < kEntityKinds; ++kind) {
+        data = reader.section(kTokenSections[kind], &words);
+        if (!sequences[kind].load(data, data ? words : 0)) return false;
+        if (sequences[kind].size() != counts[kind]) return false;
+    }
+    return true;
+}
+
+bool loadSignatureIndex(const IndexReader& reader, const std::vector<IndexUnit>& units,
+                        TokenVocabulary& bases, SignatureIndex& index) {
+    size_t functions = 0;
+    for (auto& unit : units) functions += unit.entities.functions.size();
+
+    size_t words;
+    const uint32_t* data = reader.section(kSignatureBasesSection, &words);
+    if (!bases.load(data, data ? words : 0)) return false;
+    data = reader.section(kSignatureSection, &words);
+    return index.load(data, data ? words : 0) && index.size() == functions;
+}
+
+bool loadIndex(IndexReader& reader, const std::string& path, std::vector<IndexUnit>& units) {
+    if (!reader.open(path)) {
+        return false;
+    }
+
+    size_t words;
+    const uint32_t* data = reader.section(kUnitsSection, &words);
+    IndexCursor cursor(reader, data, data ? words : 0);
+    units.resize(std::min<size_t>(cursor.u32(), words));
+    for (auto& unit : units) {
+        if (!cursor.unit(unit)) break;
+    }
+    if (!cursor.ok()) {
+        fprintf(stderr, "ERROR: index %s is corrupt\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/** Shape of the synthetic project the bench command generates */
+struct BenchCorpus {
+    size_t files = 20;
+    size_t functions = 5000;
+    size_t structs = 1000;
+    size_t typedef_depth = 4;   // length of each typedef chain
+    size_t templates = 500;     // functions with nested template signatures
+    size_t queries = 200;
+};
+
+struct Options {
+    std::string command;
+    std::vector<std::string> files;
+    std::string mode;
+    std::string query;
+    std::string compdb;
+    std::string index_path;
+    std::string output_path;
+    std::string socket_path = "seapeapea.sock";
+    std::string batch;
+    size_t max_results = 10;
+    int max_distance = -1;
+    Scorer scorer = Scorer::Auto;
+    bool tokens = false;
+    bool stats = false;
+    OutputFormat format = OutputFormat::Text;
+    ParseOptions parsing;
+    BenchCorpus corpus;
+    unsigned jobs = std::thread::hardware_concurrency();
+};
+
+bool parseOptions(int argc, char** argv, Options& opts) {
+    int i = 1;
+    static const char* commands[] = { "index", "update", "serve", "query", "bench" };
+    if (argc > 1 && std::any_of(std::begin(commands), std::end(commands),
+                                [&](const char* c){ return std::string(argv[1]) == c; })) {
+        opts.command = argv[i++];
+    }
+
+    for (; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "-j" && i + 1 < argc) {
+            opts.jobs = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--compdb" && i + 1 < argc) {
+            opts.compdb = argv[++i];
+        }
+        else if (arg == "-i" && i + 1 < argc) {
+            opts.index_path = argv[++i];
+        }
+        else if (arg == "-o" && i + 1 < argc) {
+            opts.output_path = argv[++i];
+        }
+        else if (arg == "--files" && i + 1 < argc)         { opts.corpus.files = std::max(1, atoi(argv[++i])); }
+        else if (arg == "--functions" && i + 1 < argc)     { opts.corpus.functions = std::max(0, atoi(argv[++i])); }
+        else if (arg == "--structs" && i + 1 < argc)       { opts.corpus.structs = std::max(0, atoi(argv[++i])); }
+        else if (arg == "--typedef-depth" && i + 1 < argc) { opts.corpus.typedef_depth = std::max(1, atoi(argv[++i])); }
+        else if (arg == "--templates" && i + 1 < argc)     { opts.corpus.templates = std::max(0, atoi(argv[++i])); }
+        else if (arg == "--queries" && i + 1 < argc)       { opts.corpus.queries = std::max(1, atoi(argv[++i])); }
+        else if (arg == "--batch" && i + 1 < argc) {
+            opts.batch = argv[++i];
+        }
+        else if (arg == "--socket" && i + 1 < argc) {
+            opts.socket_path = argv[++i];
+        }
+        else if (arg == "-n" && i + 1 < argc) {
+            opts.max_results = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--max-distance" && i + 1 < argc) {
+            opts.max_distance = std::max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--scorer" && i + 1 < argc) {
+            std::string scorer(argv[++i]);
+            if (scorer == "simd")             opts.scorer = Scorer::Simd;
+            else if (scorer == "bitparallel") opts.scorer = Scorer::BitParallel;
+            else                              opts.scorer = Scorer::Auto;
+        }
+        else if (arg == "--pch") {
+            opts.parsing.shared_pch = true;
+        }
+        else if (arg == "--parse" && i + 1 < argc) {
+            std::string profile(argv[++i]);
+            opts.parsing.profile = profile == "full" ? ParseProfile::Full : ParseProfile::Declarations;
+        }
+        else if (arg == "--engine" && i + 1 < argc) {
+            std::string engine(argv[++i]);
+            opts.parsing.engine = engine == "indexer" ? ParseEngine::Indexer : ParseEngine::Visitor;
+        }
+        else if (arg == "--headers") {
+            opts.parsing.headers = true;
+        }
+        else if (arg == "--tokens") {
+            opts.tokens = true;
+        }
+        else if (arg == "--format" && i + 1 < argc) {
+            std::string format(argv[++i]);
+            if (format == "jsonl")    opts.format = OutputFormat::Jsonl;
+            else if (format == "tsv") opts.format = OutputFormat::Tsv;
+            else                      opts.format = OutputFormat::Text;
+        }
+        else if (arg == "--stats") {
+            opts.stats = true;
+        }
+        else if (arg == "-f" || arg == "-t" || arg == "-s" || arg == "-c" || arg == "-u" || arg == "-p") {
+            opts.mode = arg;
+            if (opts.mode != "-p" && i + 1 < argc) opts.query = argv[++i];
+        }
+        else {
+            expandSourceSpec(arg, opts.files);
+        }
+    }
+
+    std::sort(opts.files.begin(), opts.files.end());
+    opts.files.erase(std::unique(opts.files.begin(), opts.files.end()), opts.files.end());
+
+    bool have_sources = !opts.files.empty() || !opts.compdb.empty();
+    if (opts.command == "index") {
+        if (opts.output_path.empty()) opts.output_path = "seapeapea.idx";
+        return have_sources;
+    }
+    if (opts.command == "update") {
+        if (opts.output_path.empty()) opts.output_path = opts.index_path;
+        return !opts.index_path.empty();
+    }
+    if (opts.command == "serve") {
+        return have_sources || !opts.index_path.empty();
+    }
+    if (opts.command == "bench") {
+        return true;
+    }
+    if (opts.command == "query") {
+        return !opts.mode.empty() && opts.mode != "-p";
+    }
+    return (have_sources || !opts.index_path.empty()) && (!opts.mode.empty() || !opts.batch.empty());
+}
+
+/** Source files and their flags from the command line or compilation database, not parsed yet */
+bool loadProject(const Options& opts, std::vector<IndexUnit>& units) {
+    Project project;
+    if (!opts.compdb.empty()) {
+        if (!loadCompilationDatabase(opts.compdb, opts.files, project)) {
+            return false;
+        }
+    } else {
+        for (auto& file : opts.files) {
+            project.sources.push_back(SourceFile{ file, 0 });
+        }
+    }
+
+    units.resize(project.sources.size());
+    for (size_t i = 0; i < units.size(); ++i) {
+        units[i].source.filename = project.sources[i].filename;
+        units[i].flags = project.flag_sets[project.sources[i].flags];
+    }
+    return true;
+}
+
+bool parseProject(const Options& opts, std::vector<IndexUnit>& units) {
+    if (!loadProject(opts, units)) {
+        return false;
+    }
+    std::vector<size_t> todo(units.size());
+    for (size_t i = 0; i < todo.size(); ++i) todo[i] = i;
+    return collectEntities(units, todo, opts.jobs, opts.parsing);
+}
+
+/**
+ * Units to re-parse for the released header claims that nobody holds anymore,
+ * after the units in parsed were re-parsed: every other unit including such a
+ * header with the same macros. Without them, a header claimed by a removed
+ * unit, or by one that stopped including it, would drop out of the index.
+ */
+std::vector<size_t> unitsForReleasedClaims(const std::vector<IndexUnit>& units, const std::set<std::string>& released,
+                                           const std::vector<bool>& parsed) {
+    std::unordered_set<std::string> held;
+    for (auto& unit : units) held.insert(unit.claimed.begin(), unit.claimed.end());
+    std::map<std::string, std::set<std::string>> lost;   // header -> macro keys, see ownsLocation
+    for (auto& key : released) {
+        size_t hash = key.rfind('#');
+        if (held.count(key) == 0 && hash != std::string::npos) lost[key.substr(0, hash)].insert(key.substr(hash + 1));
+    }
+
+    std::vector<size_t> orphans;
+    for (size_t i = 0; i < units.size() && !lost.empty(); ++i) {
+        // a re-parsed unit including one of them would have claimed it
+        if (parsed[i]) continue;
+        std::string macro_key;
+        for (auto& dep : units[i].deps) {
+            auto it = lost.find(dep.filename);
+            if (it == lost.end()) continue;
+            if (macro_key.empty()) macro_key = headerMacroKey(units[i]);
+            if (it->second.count(macro_key) != 0) {
+                orphans.push_back(i);
+                break;
+            }
+        }
+    }
+    return orphans;
+}
+
+/** Re-parse only the translation units whose source or headers changed since the index was written */
+bool updateIndex(const Options& opts) {
+    IndexReader reader;
+    std::vector<IndexUnit> units;
+    if (!loadIndex(reader, opts.index_path, units)) {
+        return false;
+    }
+    phaseLog().mark("load");
+
+    // units collected under other rules can't be mixed with new ones, e.g. claimed headers
+    ParseOptions indexed;
+    bool reparse = !loadParseOptions(reader, indexed)
+                   || indexed.profile != opts.parsing.profile
+                   || indexed.engine != opts.parsing.engine
+                   || indexed.headers != opts.parsing.headers;
+    if (reparse) {
+        fprintf(stderr, "%s was indexed with other --parse, --engine or --headers options, re-parsing everything\n",
+                opts.index_path.c_str());
+    }
+
+    // header claims of units that are removed or re-parsed, which may end up held by nobody
+    std::set<std::string> released;
+
+    // sources on the command line replace the indexed set, keeping units we already know
+    if (!opts.files.empty() || !opts.compdb.empty()) {
+        std::vector<IndexUnit> wanted;
+        if (!loadProject(opts, wanted)) {
+            return false;
+        }
+        std::unordered_map<std::string, IndexUnit*> known;
+        for (auto& unit : units) known[unit.source.filename] = &unit;
+        std::vector<IndexUnit> kept;
+        for (auto& unit : wanted) {
+            auto it = known.find(unit.source.filename);
+            bool same = it != known.end() && it->second->flags == unit.flags;
+            kept.push_back(std::move(same ? *it->second : unit));
+        }
+        // the units kept were moved out, so whatever claims remain belong to dropped ones
+        for (auto& unit : units) released.insert(unit.claimed.begin(), unit.claimed.end());
+        units = std::move(kept);
+    }
+
+    // headers are shared by many units, so each path is stat'ed and hashed at most once
+    std::unordered_map<std::string, FileStamp> current;
+    std::unordered_map<std::string, bool> hashed;
+    auto changed = [&](FileStamp& stamp) {
+        auto it = current.find(stamp.filename);
+        if (it == current.end()) {
+            FileStamp now;
+            if (!stampFile(stamp.filename, now, false)) now.mtime = -1;
+            it = current.emplace(stamp.filename, now).first;
+        }
+        FileStamp& now = it->second;
+        if (now.mtime < 0) return true;
+        if (now.mtime == stamp.mtime) return false;
+        if (!hashed[stamp.filename]) {
+            stampFile(stamp.filename, now);
+            hashed[stamp.filename] = true;
+        }
+        if (now.hash != stamp.hash) return true;
+        // touched but identical: remember the new mtime so we don't hash it again
+        stamp.mtime = now.mtime;
+        return false;
+    };
+
+    std::vector<size_t> todo;
+    size_t removed = 0;
+    for (size_t i = 0; i < units.size(); ++i) {
+        IndexUnit& unit = units[i];
+        if (access(unit.source.filename.c_str(), R_OK) != 0) {
+            fprintf(stderr, "%s was removed, dropping it from the index\n", unit.source.filename.c_str());
+            unit.source.filename.clear();
+            released.insert(unit.claimed.begin(), unit.claimed.end());
+            ++removed;
+            continue;
+        }
+        bool dirty = changed(unit.source);
+        for (auto& dep : unit.deps) {
+            dirty = changed(dep) || dirty;
+        }
+        if (dirty || reparse) {
+            todo.push_back(i);
+            released.insert(unit.claimed.begin(), unit.claimed.end());
+        }
+    }
+
+    phaseLog().mark("check");
+
+    if (removed > 0) {
+        std::vector<IndexUnit> kept;
+        std::vector<size_t> kept_todo;
+        for (size_t i = 0, t = 0; i < units.size(); ++i) {
+            bool is_todo = t < todo.size() && todo[t] == i;
+            if (is_todo) ++t;
+            if (units[i].source.filename.empty()) continue;
+            if (is_todo) kept_todo.push_back(kept.size());
+            kept.push_back(std::move(units[i]));
+        }
+        units = std::move(kept);
+        todo = std::move(kept_todo);
+    }
+
+    if (!todo.empty() && !collectEntities(units, todo, opts.jobs, opts.parsing)) {
+        return false;
+    }
+    if (opts.parsing.headers && !released.empty()) {
+        std::vector<bool> parsed(units.size(), false);
+        for (size_t i : todo) parsed[i] = true;
+        std::vector<size_t> orphans = unitsForReleasedClaims(units, released, parsed);
+        if (!orphans.empty()) {
+            fprintf(stderr, "re-parsing %zu more translation units for headers nobody collects anymore\n",
+                    orphans.size());
+            if (!collectEntities(units, orphans, opts.jobs, opts.parsing)) {
+                return false;
+            }
+            todo.insert(todo.end(), orphans.begin(), orphans.end());
+        }
+    }
+    phaseLog().mark("parse");
+    fprintf(stderr, "re-indexed %zu of %zu translation units\n", todo.size(), units.size());
+
+    bool saved = saveIndex(opts.output_path, units, opts.parsing);
+    phaseLog().mark("save");
+    return saved;
+}
+
+/** Everything searches need, built once; serve keeps it for all its requests */
+struct SearchState {
+    IndexReader reader;
+    QGramIndex prefilters[kEntityKinds];
+    BKTree trees[kEntityKinds];
+    TokenVocabulary vocabulary;
+    TokenSequences sequences[kEntityKinds];
+    TokenVocabulary bases;
+    SignatureIndex signatures;
+    TypeResolver resolver;
+    EntityStore entities;
+};
+
+/** Parse or load the entities and the search structures the queries of opts can use */
+bool loadSearchState(const Options& opts, SearchState& state) {
+    std::vector<IndexUnit> units;
+    if (opts.index_path.empty()) {
+        if (!parseProject(opts, units)) {
+            return false;
+        }
+    }
+    else if (!loadIndex(state.reader, opts.index_path, units)) {
+        return false;
+    }
+    else {
+        loadSearchIndexes(state.reader, state.prefilters, state.trees);
+    }
+    phaseLog().mark(opts.index_path.empty() ? "parse" : "load");
+
+    // indexes written before token matching existed don't carry the sequences
+    if (opts.tokens && !loadTokenIndexes(state.reader, units, state.vocabulary, state.sequences)) {
+        std::vector<std::string> strings[kEntityKinds];
+        normals(units, strings);
+        buildTokenIndexes(strings, state.vocabulary, state.sequences);
+    }
+    bool signatures = opts.mode == "-u" || opts.command == "serve" || !opts.batch.empty();
+    if (signatures && !loadSignatureIndex(state.reader, units, state.bases, state.signatures)) {
+        buildSignatureIndex(units, state.bases, state.signatures);
+    }
+    phaseLog().mark("indexes");
+
+    // merge in file order so results don't depend on thread scheduling
+    for (auto& unit : units) {
+        state.entities.add(std::move(unit.entities));
+        unit.releaseEntities();
+    }
+    state.entities.seal();
+    state.resolver.add(state.entities.typedefs);
+    phaseLog().mark("store");
+    return true;
+}
+
+/** Run the -f/-t/-s/-c/-u query of opts; false with a message in error if it can't be run */
+bool runQuery(const SearchState& state, const Options& opts, ScoreVec& scores, std::string& error) {
+    const std::string& mode = opts.mode;
+    const EntityStore& entities = state.entities;
+    if (mode != "-f" && mode != "-t" && mode != "-s" && mode != "-c" && mode != "-u") {
+        error = mode + " is not a search mode";
+        return false;
+    }
+
+    SearchOptions search;
+    search.max_results = opts.max_results;
+    search.jobs = opts.jobs;
+    search.scorer = opts.scorer;
+    int r = opts.max_distance;
+    if (mode == "-u") {
+        std::vector<CanonicalType> types;
+        if (!parseSignature(opts.query, state.resolver, types)) {
+            error = opts.query + " is not a signature like 'int (char *, size_t)'";
+            return false;
+        }
+        scores = getSignatureScores(entities.functions, state.signatures,
+                                    SignatureIndex::codes(types, state.bases), search, r);
+        return true;
+    }
+    if (opts.tokens) {
+        TokenPattern pattern(state.vocabulary.ids(tokenizeQuery(opts.query)));
+        auto& sequences = state.sequences;
+        if (mode == "-f")      { scores = getTokenScores(entities.functions, sequences[kFunctions], pattern, search, r); }
+        else if (mode == "-t") { scores = getTokenScores(entities.typedefs, sequences[kTypedefs], pattern, search, r); }
+        else if (mode == "-s") { scores = getTokenScores(entities.structs, sequences[kStructs], pattern, search, r); }
+        else if (mode == "-c") { scores = getTokenScores(entities.classes, sequences[kClasses], pattern, search, r); }
+        return true;
+    }
+
+    std::string normalized_query = normalizeQuery(tokenizeQuery(opts.query));
+    if (r >= 0) {
+        auto& trees = state.trees;
+        if (mode == "-f")      { scores = getRangeScores(entities.functions, normalized_query, r, &trees[kFunctions]); }
+        else if (mode == "-t") { scores = getRangeScores(entities.typedefs, normalized_query, r, &trees[kTypedefs]); }
+        else if (mode == "-s") { scores = getRangeScores(entities.structs, normalized_query, r, &trees[kStructs]); }
+        else if (mode == "-c") { scores = getRangeScores(entities.classes, normalized_query, r, &trees[kClasses]); }
+        return true;
+    }
+    auto& prefilters = state.prefilters;
+    if (mode == "-f")      { scores = getTopScores(entities.functions, normalized_query, search, &prefilters[kFunctions]); }
+    else if (mode == "-t") { scores = getTopScores(entities.typedefs, normalized_query, search, &prefilters[kTypedefs]); }
+    else if (mode == "-s") { scores = getTopScores(entities.structs, normalized_query, search, &prefilters[kStructs]); }
+    else if (mode == "-c") { scores = getTopScores(entities.classes, normalized_query, search, &prefilters[kClasses]); }
+    return true;
+}
+
+/**
+ * Answer the queries of opts.batch, one "<mode> <query>" per line, with the
+ * entities loaded once. Each query is normalized once up front. Plain top-k
+ * queries of a kind share one pass over the entities through
+ * getBatchTopScores, which beats both a scan and the q-gram prefilter per
+ * query; everything else goes through runQuery.
+ */
+bool runBatch(const SearchState& state, const Options& opts) {
+    std::ifstream file;
+    if (opts.batch != "-") {
+        file.open(opts.batch);
+        if (!file) {
+            fprintf(stderr, "ERROR: can't read %s\n", opts.batch.c_str());
+            return false;
+        }
+    }
+    std::istream& in = opts.batch == "-" ? std::cin : file;
+    std::vector<Options> queries;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t mode_end = line.find(' ');
+        if (line.empty() || mode_end == 0) continue;
+        Options query = opts;
+        query.mode = line.substr(0, mode_end);
+        size_t start = line.find_first_not_of(' ', mode_end);
+        query.query = start == std::string::npos ? std::string() : line.substr(start);
+        queries.push_back(std::move(query));
+    }
+    phaseLog().mark("read queries");
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<ScoreVec> results(queries.size());
+    std::vector<bool> answered(queries.size(), false);
+    if (!opts.tokens && opts.max_distance < 0) {
+        SearchOptions search;
+        search.max_results = opts.max_results;
+        search.jobs = opts.jobs;
+        search.scorer = opts.scorer;
+        auto batchKind = [&](const char* mode, const auto& ts) {
+            std::vector<size_t> members;
+            std::vector<std::string> normalized;
+            for (size_t q = 0; q < queries.size(); ++q) {
+                if (queries[q].mode != mode) continue;
+                members.push_back(q);
+                normalized.push_back(normalizeQuery(tokenizeQuery(queries[q].query)));
+            }
+            if (members.empty()) return;
+            std::vector<ScoreVec> scores = getBatchTopScores(ts, normalized, search);
+            for (size_t m = 0; m < members.size(); ++m) {
+                results[members[m]] = std::move(scores[m]);
+                answered[members[m]] = true;
+            }
+        };
+        const EntityStore& entities = state.entities;
+        batchKind("-f", entities.functions);
+        batchKind("-t", entities.typedefs);
+        batchKind("-s", entities.structs);
+        batchKind("-c", entities.classes);
+    }
+
+    bool ok = true;
+    std::vector<std::string> errors(queries.size());
+    for (size_t q = 0; q < queries.size(); ++q) {
+        if (!answered[q] && !runQuery(state, queries[q], results[q], errors[q])) ok = false;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    phaseLog().mark("search");
+
+    OutputWriter out(opts.format);
+    for (size_t q = 0; q < queries.size(); ++q) {
+        const std::string& mode = queries[q].mode;
+        const std::string& query = queries[q].query;
+        out.banner(mode + " " + query);
+        if (!errors[q].empty()) {
+            fprintf(stderr, "ERROR: %s\n", errors[q].c_str());
+        }
+        writeMatches(out, state.entities, mode, results[q], &query);
+    }
+    out.flush();
+    phaseLog().mark("output");
+    fprintf(stderr, "answered %zu queries in %.3fs, %.0f queries/s\n",
+            queries.size(), elapsed.count(), queries.size() / std::max(elapsed.count(), 1e-9));
+    return ok;
+}
+
+/** s as a JSON string literal */
+std::string jsonString(std::string_view s) {
+    std::string out = "\"";
+    escapeJson(s, [&out](std::string_view piece) { out += piece; });
+    return out + "\"";
+}
+
+/*
+ * serve protocol: one request per line, "<mode> <max results> <max distance> <query>",
+ * answered by one line of JSON, either {"matches":[{"id":..., "score":...}, ...]} or
+ * {"error":...}. A max distance below 0 asks for the best max results matches; max
+ * results must be at least 1 and is capped at kMaxRequestResults.
+ */
+constexpr long long kMaxRequestResults = 10000;
+
+std::string answerRequest(const SearchState& state, const Options& opts, const std::string& line) {
+    Options request = opts;
+    char mode[3];
+    long long max_results = 0;
+    int consumed = 0;
+    if (sscanf(line.c_str(), "%2s %lld %d %n", mode, &max_results, &request.max_distance, &consumed) != 3
+        || consumed == 0) {
+        return "{\"error\":" + jsonString("bad request: " + line) + "}\n";
+    }
+    if (max_results < 1) {
+        return "{\"error\":" + jsonString("bad request: max results must be at least 1: " + line) + "}\n";
+    }
+    request.mode = mode;
+    request.query = line.substr(consumed);
+    request.max_results = std::min(max_results, kMaxRequestResults);
+
+    ScoreVec scores;
+    std::string error;
+    if (!runQuery(state, request, scores, error)) {
+        return "{\"error\":" + jsonString(error) + "}\n";
+    }
+    std::string response = "{\"matches\":[";
+    for (size_t i = 0; i < scores.size(); ++i) {
+        if (i > 0) response += ',';
+        response += "{\"id\":" + jsonString(scoreId(state.entities, request.mode, scores[i])) + ",\"score\":" + std::to_string(scores[i].score) + "}";
+    }
+    return response + "]}\n";
+}
+
+/** Answer the requests of one connection until the client hangs up */
+void serveClient(int fd, const SearchState& state, const Options& opts) {
+    std::string pending;
+    char buffer[4096];
+    for (;;) {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        pending.append(buffer, got);
+        size_t newline;
+        while ((newline = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            // one bad request mustn't take down the server and every other client with it
+            std::string response;
+            try {
+                response = answerRequest(state, opts, line);
+            } catch (const std::exception& e) {
+                response = "{\"error\":" + jsonString(std::string("failed: ") + e.what()) + "}\n";
+            }
+            if (!writeAll(fd, response)) {
+                close(fd);
+                return;
+            }
+        }
+    }
+    close(fd);
+}
+
+bool socketAddress(const std::string& path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "ERROR: socket path %s is too long\n", path.c_str());
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+/** Keep state in memory and answer queries on opts.socket_path, a thread per connection */
+bool serve(const Options& opts, const SearchState& state) {
+    sockaddr_un address;
+    if (!socketAddress(opts.socket_path, address)) {
+        return false;
+    }
+    // a socket left behind by a server that was killed
+    struct stat st;
+    if (stat(opts.socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(opts.socket_path.c_str());
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        fprintf(stderr, "ERROR: can't listen on %s: %s\n", opts.socket_path.c_str(), strerror(errno));
+        if (listener >= 0) close(listener);
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "serving %zu functions, %zu typedefs, %zu structs and %zu classes on %s\n",
+            state.entities.functions.size(), state.entities.typedefs.size(),
+            state.entities.structs.size(), state.entities.classes.size(), opts.socket_path.c_str());
+
+    for (;;) {
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "ERROR: accept() failed on %s: %s\n", opts.socket_path.c_str(), strerror(errno));
+            close(listener);
+            return false;
+        }
+        try {
+            std::thread(serveClient, client, std::cref(state), std::cref(opts)).detach();
+        } catch (const std::system_error& e) {
+            fprintf(stderr, "ERROR: can't serve a client on %s: %s\n", opts.socket_path.c_str(), e.what());
+            close(client);
+        }
+    }
+}
+
+/** Send the query of opts to a running server and print its response */
+bool askServer(const Options& opts) {
+    sockaddr_un address;
+    if (!socketAddress(opts.socket_path, address)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "ERROR: can't connect to %s: %s\n", opts.socket_path.c_str(), strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    std::string query = opts.query;
+    std::replace(query.begin(), query.end(), '\n', ' ');
+    std::string request = opts.mode + " " + std::to_string(opts.max_results) + " "
+                        + std::to_string(opts.max_distance) + " " + query + "\n";
+    std::string response;
+    char buffer[4096];
+    bool ok = writeAll(fd, request);
+    while (ok && response.find('\n') == std::string::npos) {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        response.append(buffer, got);
+    }
+    close(fd);
+    if (response.find('\n') == std::string::npos) {
+        fprintf(stderr, "ERROR: no response from %s\n", opts.socket_path.c_str());
+        return false;
+    }
+    fwrite(response.data(), 1, response.size(), stdout);
+    return true;
+}
+
+/**
+ * Write a synthetic C++ project of the size in corpus to dir: one header of
+ * typedef chains and templates, included by files of structs, functions
+ * with loops in their bodies and functions with nested template signatures.
+ */
+std::vector<std::string> generateCorpus(const std::string& dir, const BenchCorpus& corpus) {
+    static const char* bases[] = { "int", "long", "unsigned", "double", "short" };
+    constexpr size_t base_count = sizeof(bases) / sizeof(bases[0]);
+    auto chain = [&](size_t n) {
+        return "chain" + std::to_string(n % base_count) + "_" + std::to_string(n / base_count % corpus.typedef_depth);
+    };
+
+    std::ofstream header(dir + "/common.hpp");
+    header << "#pragma once\n";
+    for (size_t b = 0; b < base_count; ++b) {
+        header << "typedef " << bases[b] << " chain" << b << "_0;\n";
+        for (size_t d = 1; d < corpus.typedef_depth; ++d) {
+            header << "typedef chain" << b << "_" << d - 1 << " chain" << b << "_" << d << ";\n";
+        }
+    }
+    header << "template<typename A, typename B> struct pair_t { A first; B second; };\n";
+    header << "template<typename T> struct box_t { T value; };\n";
+
+    std::vector<std::string> files;
+    for (size_t f = 0; f < corpus.files; ++f) {
+        files.push_back(dir + "/file" + std::to_string(f) + ".cpp");
+        std::ofstream out(files.back());
+        out << "#include \"common.hpp\"\n";
+        std::string record = "void";
+        for (size_t i = f; i < corpus.structs; i += corpus.files) {
+            record = "struct rec" + std::to_string(i);
+            out << record << " { " << chain(i) << " key; " << chain(i + 1) << " value; "
+                << record << "* next; };\n";
+        }
+        for (size_t i = f; i < corpus.functions; i += corpus.files) {
+            out << chain(i) << " fn" << i << "(" << record << "* r, " << chain(i + 2) << " n) {\n"
+                << "    " << chain(i) << " acc = 0;\n"
+                << "    for (int k = 0; k < (int)n; ++k) {\n"
+                << "        acc += k * " << i % 7 + 1 << ";\n"
+                << "        if (acc > 1000) acc -= " << i % 13 << ";\n"
+                << "    }\n"
+                << "    return r ? acc : -acc;\n"
+                << "}\n";
+        }
+        for (size_t i = f; i < corpus.templates; i += corpus.files) {
+            std::string result = "box_t<pair_t<" + chain(i) + ", box_t<long> > >";
+            out << result << " tfn" << i << "(pair_t<int, box_t<" << chain(i + 3) << "> > p, "
+                << "box_t<pair_t<" << chain(i + 1) << ", " << chain(i + 4) << "> >* q) {\n"
+                << "    " << result << " r = {};\n"
+                << "    r.value.first = p.first + (q ? 1 : 0);\n"
+                << "    return r;\n"
+                << "}\n";
+        }
+    }
+    return files;
+}
+
+/**
+ * The bench command: generate a corpus, then time every phase of indexing
+ * and searching it on its own and print the times in seconds as JSON.
+ * Files are parsed and visited one at a time on one thread, so parse and
+ * collect can be told apart; scoring uses -j threads.
+ */
+bool runBenchmark(const Options& opts) {
+    typedef std::chrono::steady_clock Clock;
+    auto seconds = [](Clock::time_point since) {
+        return std::chrono::duration<double>(Clock::now() - since).count();
+    };
+    const BenchCorpus& corpus = opts.corpus;
+    std::string dir = (std::filesystem::temp_directory_path() /
+                       ("seapeapea-bench-" + std::to_string(getpid()))).string();
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    if (error) {
+        fprintf(stderr, "ERROR: can't create %s: %s\n", dir.c_str(), error.message().c_str());
+        return false;
+    }
+
+    auto start = Clock::now();
+    std::vector<std::string> files = generateCorpus(dir, corpus);
+    double generate = seconds(start);
+
+    CXIndex index = clang_createIndex(1, 0);
+    if (index == 0) {
+        fprintf(stderr, "ERROR: clang_createIndex() failed\n");
+        return false;
+    }
+    std::string include = "-I" + dir;
+    const char* args[] = { "-xc++", "-std=c++17", include.c_str() };
+    std::vector<IndexUnit> units(files.size());
+    double parse = 0, collect = 0;
+    for (size_t f = 0; f < files.size(); ++f) {
+        start = Clock::now();
+        CXTranslationUnit translation_unit = clang_parseTranslationUnit(
+            index, files[f].c_str(), args, 3, NULL, 0, parseFlags(opts.parsing.profile));
+        parse += seconds(start);
+        if (translation_unit == NULL) {
+            fprintf(stderr, "ERROR: clang_parseTranslationUnit() failed for %s\n", files[f].c_str());
+            clang_disposeIndex(index);
+            std::filesystem::remove_all(dir, error);
+            return false;
+        }
+        start = Clock::now();
+        VisitContext context;
+        context.entities = &units[f].entities;
+        clang_visitChildren(clang_getTranslationUnitCursor(translation_unit), *cursorVisitor, &context);
+        collect += seconds(start);
+        clang_disposeTranslationUnit(translation_unit);
+    }
+    clang_disposeIndex(index);
+    std::filesystem::remove_all(dir, error);
+
+    start = Clock::now();
+    EntityStore entities;
+    for (auto& unit : units) {
+        entities.add(std::move(unit.entities));
+        unit.releaseEntities();
+    }
+    entities.seal();
+    double store = seconds(start);
+
+    std::vector<std::string> queries;
+    for (size_t q = 0; q < corpus.queries; ++q) {
+        size_t i = q * 7919 % std::max<size_t>(corpus.functions, 1);
+        queries.push_back("long fn" + std::to_string(i) + " (rec" + std::to_string(q % 97) + " *, chain"
+                          + std::to_string(q % 5) + "_1)");
+    }
+
+    start = Clock::now();
+    std::vector<std::string> normalized;
+    for (auto& query : queries) normalized.push_back(normalizeQuery(tokenizeQuery(query)));
+    double normalize = seconds(start);
+
+    // the original full scan and sort, kept for comparison with getTopScores
+    double all_scores = 0, sort_scores = 0;
+    for (size_t q = 0; q < normalized.size() && q < 10; ++q) {
+        start = Clock::now();
+        ScoreVec scores = getScores(entities.functions, normalized[q]);
+        all_scores += seconds(start);
+        start = Clock::now();
+        sortScores(scores);
+        sort_scores += seconds(start);
+    }
+
+    SearchOptions search;
+    search.max_results = opts.max_results;
+    search.jobs = opts.jobs;
+    search.scorer = opts.scorer;
+    std::vector<ScoreVec> results;
+    start = Clock::now();
+    for (auto& query : normalized) results.push_back(getTopScores(entities.functions, query, search));
+    double top_scores = seconds(start);
+
+    // rendered the way a search prints its matches, into /dev/null so only formatting and write() count
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    size_t output_bytes = 0;
+    start = Clock::now();
+    {
+        OutputWriter out(opts.format, null_fd);
+        for (auto& scores : results) {
+            out.banner("Best matches");
+            writeMatches(out, entities, "-f", scores);
+        }
+        out.flush();
+        output_bytes = out.bytes();
+    }
+    double render = seconds(start);
+    if (null_fd >= 0) close(null_fd);
+
+    printf("{\n");
+    printf("  \"corpus\": { \"files\": %zu, \"functions\": %zu, \"structs\": %zu, \"typedef_depth\": %zu, "
+           "\"templates\": %zu, \"queries\": %zu },\n", corpus.files, corpus.functions, corpus.structs,
+           corpus.typedef_depth, corpus.templates, corpus.queries);
+    printf("  \"collected\": { \"functions\": %zu, \"typedefs\": %zu, \"structs\": %zu, \"classes\": %zu },\n",
+           entities.functions.size(), entities.typedefs.size(), entities.structs.size(), entities.classes.size());
+    printf("  \"parse_profile\": \"%s\", \"jobs\": %u, \"full_scan_queries\": %zu, \"output_bytes\": %zu,\n",
+           opts.parsing.profile == ParseProfile::Full ? "full" : "decls", opts.jobs,
+           std::min<size_t>(normalized.size(), 10), output_bytes);
+    printf("  \"seconds\": {\n");
+    printf("    \"generate\": %.6f,\n", generate);
+    printf("    \"parse\": %.6f,\n", parse);
+    printf("    \"collect\": %.6f,\n", collect);
+    printf("    \"store\": %.6f,\n", store);
+    printf("    \"normalizeQuery\": %.6f,\n", normalize);
+    printf("    \"getScores\": %.6f,\n", all_scores);
+    printf("    \"sortScores\": %.6f,\n", sort_scores);
+    printf("    \"getTopScores\": %.6f,\n", top_scores);
+    printf("    \"output\": %.6f\n", render);
+    printf("  }\n");
+    printf("}\n");
+    return true;
+}
+
+bool runCommand(const Options& opts) {
+    PhaseLog& phases = phaseLog();
+    if (opts.command == "update") {
+        return updateIndex(opts);
+    }
+    if (opts.command == "query") {
+        return askServer(opts);
+    }
+    if (opts.command == "bench") {
+        return runBenchmark(opts);
+    }
+    if (opts.command == "index") {
+        std::vector<IndexUnit> units;
+        auto start = std::chrono::steady_clock::now();
+        if (!parseProject(opts, units)) {
+            return false;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "parsed %zu translation units in %.2fs\n", units.size(), elapsed.count());
+        phases.mark("parse");
+        bool saved = saveIndex(opts.output_path, units, opts.parsing);
+        phases.mark("save");
+        return saved;
+    }
+
+    SearchState state;
+    if (!loadSearchState(opts, state)) {
+        return false;
+    }
+    if (opts.command == "serve") {
+        if (opts.stats) phases.report();
+        return serve(opts, state);
+    }
+    if (!opts.batch.empty()) {
+        return runBatch(state, opts);
+    }
+
+    const EntityStore& entities = state.entities;
+    if (opts.mode == "-p") {
+        OutputWriter out(opts.format);
+        printCX(out, entities.functions, "FUNCTIONS");
+        printCX(out, entities.typedefs, "TYPEDEFS");
+        printCX(out, entities.structs, "STRUCTS");
+        printCX(out, entities.classes, "CLASSES");
+        out.flush();
+        phases.mark("output");
+        return true;
+    }
+
+    ScoreVec scores;
+    std::string error;
+    if (!runQuery(state, opts, scores, error)) {
+        fprintf(stderr, "ERROR: %s\n", error.c_str());
+        return false;
+    }
+    phases.mark("search");
+    OutputWriter out(opts.format);
+    out.banner("Best matches");
+    writeMatches(out, entities, opts.mode, scores);
+    // printf("%s\n", scoreId(entities, opts.mode, bestMatch(scores)).c_str());
+    out.flush();
+    phases.mark("output");
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    if (!parseOptions(argc, argv, opts)) {
+        usage(argv);
+        return 0;
+    }
+
+    bool ok = runCommand(opts);
+    if (opts.stats) {
+        phaseLog().report();
+    }
+    return ok ? 0 : 1;
+}